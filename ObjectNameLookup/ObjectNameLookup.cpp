@@ -14,17 +14,39 @@
 
 #include <Windows.h>
 #include <winternl.h>
+#include <DbgHelp.h>
+#include <Psapi.h>
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 #include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <wctype.h>
 #include <vector>
 #include <string>
 #include <sstream>
 #include <memory>
 #include <chrono>
+#include <random>
+#include <algorithm>
+#include <map>
+#include <array>
+#include <cmath>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <fstream>
 
 using namespace std;
 using namespace std::chrono;
 
 #pragma comment(lib, "ntdll.lib")
+#pragma comment(lib, "dbghelp.lib")
+#pragma comment(lib, "psapi.lib")
+#pragma comment(lib, "winmm.lib")
+#pragma comment(lib, "advapi32.lib")
 
 extern "C" {
     enum EVENT_TYPE {
@@ -64,6 +86,28 @@ extern "C" {
     {
         UNICODE_STRING Name;
     } OBJECT_NAME_INFORMATION, * POBJECT_NAME_INFORMATION;
+
+    NTSYSAPI NTSTATUS RtlAdjustPrivilege(ULONG Privilege, BOOLEAN Enable,
+        BOOLEAN CurrentThread, PBOOLEAN Enabled);
+
+    NTSYSAPI ULONG RtlLengthRequiredSid(ULONG SubAuthorityCount);
+
+    NTSYSAPI NTSTATUS RtlInitializeSid(PSID Sid,
+        PSID_IDENTIFIER_AUTHORITY IdentifierAuthority, UCHAR SubAuthorityCount);
+
+    NTSYSAPI PULONG RtlSubAuthoritySid(PSID Sid, ULONG SubAuthority);
+
+    NTSYSAPI NTSTATUS RtlCreateAcl(PACL Acl, ULONG AclLength, ULONG AclRevision);
+
+    NTSYSAPI NTSTATUS RtlAddAccessAllowedAce(PACL Acl, ULONG AceRevision,
+        ACCESS_MASK AccessMask, PSID Sid);
+
+    NTSYSAPI NTSTATUS RtlCreateSecurityDescriptor(
+        PSECURITY_DESCRIPTOR SecurityDescriptor, ULONG Revision);
+
+    NTSYSAPI NTSTATUS RtlSetDaclSecurityDescriptor(
+        PSECURITY_DESCRIPTOR SecurityDescriptor, BOOLEAN DaclPresent,
+        PACL Dacl, BOOLEAN DaclDefaulted);
 }
 
 class NtException {
@@ -77,6 +121,17 @@ private:
     NTSTATUS m_status;
 };
 
+class ArgException {
+public:
+    explicit ArgException(const string& message)
+        : m_message(message) {}
+    const string& message() const {
+        return m_message;
+    }
+private:
+    string m_message;
+};
+
 static void Check(NTSTATUS status) {
     if (NT_ERROR(status)) {
         throw NtException(status);
@@ -103,8 +158,22 @@ public:
         other.m_handle = nullptr;
     }
     const ScopedHandle& operator=(const ScopedHandle&) = delete;
+    ScopedHandle& operator=(ScopedHandle&& other) noexcept {
+        if (this != &other) {
+            reset(other.m_handle);
+            other.m_handle = nullptr;
+        }
+        return *this;
+    }
     ~ScopedHandle() {
-        ::CloseHandle(m_handle);
+        reset();
+    }
+
+    void reset(HANDLE handle = nullptr) {
+        if (m_handle) {
+            ::CloseHandle(m_handle);
+        }
+        m_handle = handle;
     }
 
     HANDLE get() const {
@@ -119,7 +188,7 @@ public:
         return GetName(m_handle);
     }
 private:
-    HANDLE m_handle;
+    HANDLE m_handle = nullptr;
 };
 
 class Timer {
@@ -137,8 +206,407 @@ private:
     high_resolution_clock::time_point m_start;
 };
 
+static int HighestBit(uint64_t value) {
+    int bit = 0;
+    while (value >>= 1) {
+        bit++;
+    }
+    return bit;
+}
+
+// Log-linear latency histogram in the style of HdrHistogram. Each power of
+// two is split into 2^(precision-1) linear sub-buckets, so any recorded value
+// is reported within a relative error of 2^-(precision-1) using a fixed
+// amount of memory whatever the range of values.
+class Histogram {
+public:
+    explicit Histogram(int precision = 7)
+        : m_precision(precision), m_counts(static_cast<size_t>(66 - precision) << (precision - 1)) {}
+
+    void Record(uint64_t value) {
+        m_counts[GetIndex(value)]++;
+        if (m_count == 0 || value < m_min) {
+            m_min = value;
+        }
+        if (value > m_max) {
+            m_max = value;
+        }
+        m_count++;
+        m_total += value;
+    }
+
+    // Adds the values from another histogram, such as one recorded on
+    // another thread.
+    void Merge(const Histogram& other) {
+        for (size_t i = 0; i < other.m_counts.size(); ++i) {
+            if (other.m_counts[i]) {
+                m_counts[GetIndex(other.GetValue(i))] += other.m_counts[i];
+            }
+        }
+        if (other.m_count && (m_count == 0 || other.m_min < m_min)) {
+            m_min = other.m_min;
+        }
+        if (other.m_max > m_max) {
+            m_max = other.m_max;
+        }
+        m_count += other.m_count;
+        m_total += other.m_total;
+    }
+
+    uint64_t GetPercentile(double percentile) const {
+        uint64_t target = static_cast<uint64_t>(ceil(percentile / 100.0 * m_count));
+        if (target == 0) {
+            target = 1;
+        }
+        uint64_t seen = 0;
+        for (size_t i = 0; i < m_counts.size(); ++i) {
+            seen += m_counts[i];
+            if (seen >= target) {
+                uint64_t value = GetValue(i + 1) - 1;
+                return value < m_max ? value : m_max;
+            }
+        }
+        return m_max;
+    }
+
+    // Gets the half width of the 95% confidence interval of the median,
+    // relative to the median, using the order statistics which bound it.
+    double GetMedianConfidence() const {
+        if (m_count < 2) {
+            return HUGE_VAL;
+        }
+        double half_width = 1.96 * sqrt(static_cast<double>(m_count)) / 2.0;
+        double lower = static_cast<double>(GetPercentile(100.0 * (m_count / 2.0 - half_width) / m_count));
+        double upper = static_cast<double>(GetPercentile(100.0 * (m_count / 2.0 + half_width + 1) / m_count));
+        double median = static_cast<double>(GetPercentile(50.0));
+        return median > 0 ? (upper - lower) / 2.0 / median : HUGE_VAL;
+    }
+
+    uint64_t count() const {
+        return m_count;
+    }
+
+    uint64_t total() const {
+        return m_total;
+    }
+
+    uint64_t minimum() const {
+        return m_min;
+    }
+
+    uint64_t maximum() const {
+        return m_max;
+    }
+
+private:
+    size_t GetIndex(uint64_t value) const {
+        if (value < (1ull << m_precision)) {
+            return static_cast<size_t>(value);
+        }
+        int shift = HighestBit(value) - (m_precision - 1);
+        return (static_cast<size_t>(shift) << (m_precision - 1)) + static_cast<size_t>(value >> shift);
+    }
+
+    // Gets the lowest value which maps to an index.
+    uint64_t GetValue(size_t index) const {
+        size_t half = static_cast<size_t>(1) << (m_precision - 1);
+        if (index < half * 2) {
+            return index;
+        }
+        size_t shift = index / half - 1;
+        return static_cast<uint64_t>(index - shift * half) << shift;
+    }
+
+    int m_precision;
+    vector<uint64_t> m_counts;
+    uint64_t m_count = 0;
+    uint64_t m_total = 0;
+    uint64_t m_min = 0;
+    uint64_t m_max = 0;
+};
+
+// Counts of latencies in power of two buckets for each fixed length slice
+// of a measurement, to show periodic stalls during long runs.
+class Heatmap {
+public:
+    explicit Heatmap(double interval_us = 0)
+        : m_interval_us(interval_us) {}
+
+    void Record(double at_us, uint64_t value) {
+        if (m_interval_us <= 0) {
+            return;
+        }
+        size_t slice = static_cast<size_t>(at_us / m_interval_us);
+        if (slice >= m_slices.size()) {
+            m_slices.resize(slice + 1);
+        }
+        m_slices[slice][HighestBit(value)]++;
+    }
+
+    void Merge(const Heatmap& other) {
+        if (other.m_slices.size() > m_slices.size()) {
+            m_slices.resize(other.m_slices.size());
+        }
+        for (size_t slice = 0; slice < other.m_slices.size(); ++slice) {
+            for (size_t bucket = 0; bucket < other.m_slices[slice].size(); ++bucket) {
+                m_slices[slice][bucket] += other.m_slices[slice][bucket];
+            }
+        }
+    }
+
+    // Writes a CSV row for each non-empty cell, prefixed with tag.
+    void Write(FILE* fp, const string& tag) const {
+        for (size_t slice = 0; slice < m_slices.size(); ++slice) {
+            for (size_t bucket = 0; bucket < m_slices[slice].size(); ++bucket) {
+                if (m_slices[slice][bucket]) {
+                    fprintf(fp, "%s,%f,%llu,%llu\n", tag.c_str(), slice * m_interval_us / 1000.0,
+                        1ull << bucket, static_cast<unsigned long long>(m_slices[slice][bucket]));
+                }
+            }
+        }
+    }
+
+private:
+    double m_interval_us;
+    vector<array<uint64_t, 64>> m_slices;
+};
+
+// Memory used by the process in bytes. The pool is charged for the kernel
+// memory of every object and handle the process creates.
+struct MemoryUsage {
+    int64_t working_set = 0;
+    int64_t peak_working_set = 0;
+    int64_t private_bytes = 0;
+    int64_t paged_pool = 0;
+    int64_t nonpaged_pool = 0;
+    int64_t heap_allocated = 0;
+    int64_t heap_committed = 0;
+
+    int64_t pool() const {
+        return paged_pool + nonpaged_pool;
+    }
+};
+
+static MemoryUsage GetMemoryUsage() {
+    MemoryUsage usage;
+    PROCESS_MEMORY_COUNTERS counters = {};
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        usage.working_set = counters.WorkingSetSize;
+        usage.peak_working_set = counters.PeakWorkingSetSize;
+        usage.private_bytes = counters.PagefileUsage;
+        usage.paged_pool = counters.QuotaPagedPoolUsage;
+        usage.nonpaged_pool = counters.QuotaNonPagedPoolUsage;
+    }
+    HEAP_SUMMARY heap = {};
+    heap.cb = sizeof(heap);
+    if (HeapSummary(GetProcessHeap(), 0, &heap)) {
+        usage.heap_allocated = heap.cbAllocated;
+        usage.heap_committed = heap.cbCommitted;
+    }
+    return usage;
+}
+
+// Wall time spent in each named phase of a point, such as building the
+// namespace, measuring and tearing down, and the process's memory at the
+// start and end of the phase.
+class PhaseLog {
+public:
+    struct Phase {
+        const char* name;
+        double ms;
+        MemoryUsage start;
+        MemoryUsage end;
+    };
+
+    void Begin(const char* name) {
+        End();
+        m_current = name;
+        m_start_usage = GetMemoryUsage();
+        m_start = high_resolution_clock::now();
+    }
+
+    void End() {
+        if (m_current) {
+            double ms = duration<double, milli>(high_resolution_clock::now() - m_start).count();
+            m_phases.push_back(Phase{ m_current, ms, m_start_usage, GetMemoryUsage() });
+            m_current = nullptr;
+        }
+    }
+
+    void Clear() {
+        m_phases.clear();
+        m_current = nullptr;
+    }
+
+    const char* current() const {
+        return m_current ? m_current : "";
+    }
+
+    const vector<Phase>& phases() const {
+        return m_phases;
+    }
+
+private:
+    const char* m_current = nullptr;
+    high_resolution_clock::time_point m_start;
+    MemoryUsage m_start_usage;
+    vector<Phase> m_phases;
+};
+
+static PhaseLog g_phases;
+
+static void BeginPhase(const char* name) {
+    g_phases.Begin(name);
+}
+
+// Shows the progress of a long setup loop on stderr so it doesn't get mixed
+// in with the results.
+static void ShowProgress(int done, int total) {
+    int step = total / 100;
+    if (step < 10 || ((done % step) != 0 && done != total)) {
+        return;
+    }
+    fprintf(stderr, "\r%s %d/%d", g_phases.current(), done, total);
+    if (done == total) {
+        fprintf(stderr, "\r%*s\r", 40, "");
+    }
+}
+
+// Sampled stacks, leaf frame first, with the number of times each was seen.
+typedef map<vector<DWORD64>, uint64_t> StackSamples;
+
+// Samples the stack of the current thread at a fixed interval by suspending
+// it from a background thread. Only user mode frames are visible, time spent
+// in the kernel is attributed to the system call stub. The process heap is
+// locked before suspending so the thread can't be stopped inside the heap
+// while StackWalk64 allocates. Requires SymInitialize to have been called.
+class SamplingProfiler {
+public:
+    explicit SamplingProfiler(int interval_ms) {
+        DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), m_thread.ptr(),
+            THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_INFORMATION, FALSE, 0);
+        m_sampler = thread([this, interval_ms]() {
+            while (!m_stop) {
+                Sleep(interval_ms);
+                Sample();
+            }
+        });
+    }
+    SamplingProfiler(const SamplingProfiler&) = delete;
+    ~SamplingProfiler() {
+        Stop();
+    }
+
+    StackSamples Stop() {
+        m_stop = true;
+        if (m_sampler.joinable()) {
+            m_sampler.join();
+        }
+        return move(m_stacks);
+    }
+
+private:
+    static const int kMaxFrames = 64;
+
+    void Sample() {
+        DWORD64 frames[kMaxFrames];
+        int count = 0;
+        HANDLE heap = GetProcessHeap();
+        HeapLock(heap);
+        if (SuspendThread(m_thread.get()) == static_cast<DWORD>(-1)) {
+            HeapUnlock(heap);
+            return;
+        }
+        CONTEXT context = {};
+        context.ContextFlags = CONTEXT_FULL;
+        if (GetThreadContext(m_thread.get(), &context)) {
+            STACKFRAME64 frame = {};
+            DWORD machine = InitStackFrame(context, frame);
+            while (count < kMaxFrames && StackWalk64(machine, GetCurrentProcess(), m_thread.get(), &frame,
+                &context, nullptr, SymFunctionTableAccess64, SymGetModuleBase64, nullptr) && frame.AddrPC.Offset) {
+                frames[count++] = frame.AddrPC.Offset;
+            }
+        }
+        ResumeThread(m_thread.get());
+        HeapUnlock(heap);
+        if (count > 0) {
+            m_stacks[vector<DWORD64>(frames, frames + count)]++;
+        }
+    }
+
+    static DWORD InitStackFrame(const CONTEXT& context, STACKFRAME64& frame) {
+        frame.AddrPC.Mode = AddrModeFlat;
+        frame.AddrFrame.Mode = AddrModeFlat;
+        frame.AddrStack.Mode = AddrModeFlat;
+#if defined(_M_X64)
+        frame.AddrPC.Offset = context.Rip;
+        frame.AddrFrame.Offset = context.Rbp;
+        frame.AddrStack.Offset = context.Rsp;
+        return IMAGE_FILE_MACHINE_AMD64;
+#elif defined(_M_ARM64)
+        frame.AddrPC.Offset = context.Pc;
+        frame.AddrFrame.Offset = context.Fp;
+        frame.AddrStack.Offset = context.Sp;
+        return IMAGE_FILE_MACHINE_ARM64;
+#else
+        frame.AddrPC.Offset = context.Eip;
+        frame.AddrFrame.Offset = context.Ebp;
+        frame.AddrStack.Offset = context.Esp;
+        return IMAGE_FILE_MACHINE_I386;
+#endif
+    }
+
+    ScopedHandle m_thread;
+    thread m_sampler;
+    atomic<bool> m_stop{ false };
+    StackSamples m_stacks;
+};
+
+static string GetSymbolName(DWORD64 address) {
+    static map<DWORD64, string> cache;
+    auto it = cache.find(address);
+    if (it != cache.end()) {
+        return it->second;
+    }
+
+    HANDLE process = GetCurrentProcess();
+    IMAGEHLP_MODULE64 module = {};
+    module.SizeOfStruct = sizeof(module);
+    string name = SymGetModuleInfo64(process, address, &module) ? module.ModuleName : "?";
+    auto buffer = make_unique<char[]>(sizeof(SYMBOL_INFO) + MAX_SYM_NAME);
+    SYMBOL_INFO* symbol = reinterpret_cast<SYMBOL_INFO*>(buffer.get());
+    symbol->SizeOfStruct = sizeof(SYMBOL_INFO);
+    symbol->MaxNameLen = MAX_SYM_NAME;
+    DWORD64 displacement = 0;
+    if (SymFromAddr(process, address, &displacement, symbol)) {
+        name += "!" + string(symbol->Name);
+    }
+    else {
+        stringstream ss;
+        ss << "!0x" << hex << address;
+        name += ss.str();
+    }
+    cache[address] = name;
+    return name;
+}
+
+// Writes stacks in the folded format used by flame graph tools, with tag as
+// the root frame.
+static void WriteFoldedStacks(FILE* fp, const string& tag, const StackSamples& stacks) {
+    for (const auto& stack : stacks) {
+        string line = tag;
+        for (auto frame = stack.first.rbegin(); frame != stack.first.rend(); ++frame) {
+            line += ";" + GetSymbolName(*frame);
+        }
+        fprintf(fp, "%s %llu\n", line.c_str(), static_cast<unsigned long long>(stack.second));
+    }
+}
+
 struct UnicodeString : public UNICODE_STRING {
     explicit UnicodeString(const wstring& str) : m_str(str) {
+        if (m_str.size() > USHRT_MAX / sizeof(wchar_t)) {
+            throw ArgException("Name is longer than a UNICODE_STRING can hold.");
+        }
         MaximumLength = Length = (USHORT)(m_str.size() * sizeof(wchar_t));
         Buffer = const_cast<wchar_t*>(m_str.c_str());
     }
@@ -155,30 +623,124 @@ private:
     UnicodeString m_str;
 };
 
-static ScopedHandle CreateDirectory(const wstring& name, HANDLE root = nullptr, HANDLE shadow_dir = nullptr) {
-    ObjectAttributes obja(name, root);
+// Object attributes for a name owned by someone else, such as a view into
+// a name pool, which is used without copying it.
+struct NameViewAttributes : public OBJECT_ATTRIBUTES {
+    NameViewAttributes(const UNICODE_STRING& name, HANDLE root = nullptr, ULONG attributes = 0)
+        : m_name(name) {
+        InitializeObjectAttributes(this, &m_name, attributes, root, nullptr);
+    }
+private:
+    UNICODE_STRING m_name;
+};
+
+static const ULONG kChangeNotifyPrivilege = 23;
+
+// Makes a SID the caller won't have, S-1-5-21-0-0-0-rid.
+static unique_ptr<char[]> MakeUnknownSid(ULONG rid) {
+    SID_IDENTIFIER_AUTHORITY authority = SECURITY_NT_AUTHORITY;
+    auto sid = make_unique<char[]>(RtlLengthRequiredSid(5));
+    Check(RtlInitializeSid(sid.get(), &authority, 5));
+    *RtlSubAuthoritySid(sid.get(), 0) = 21;
+    for (ULONG i = 1; i < 4; ++i) {
+        *RtlSubAuthoritySid(sid.get(), i) = 0;
+    }
+    *RtlSubAuthoritySid(sid.get(), 4) = rid;
+    return sid;
+}
+
+// Security descriptor for created directories whose DACL has ace_count ACEs
+// for SIDs the caller doesn't have ahead of an ACE granting Everyone full
+// access, so every access check on a directory scans them all.
+class DirectorySecurity {
+public:
+    explicit DirectorySecurity(int ace_count) {
+        SID_IDENTIFIER_AUTHORITY world_authority = SECURITY_WORLD_SID_AUTHORITY;
+        auto world_sid = make_unique<char[]>(RtlLengthRequiredSid(1));
+        Check(RtlInitializeSid(world_sid.get(), &world_authority, 1));
+        *RtlSubAuthoritySid(world_sid.get(), 0) = 0;
+
+        ULONG ace_size = sizeof(ACCESS_ALLOWED_ACE) - sizeof(DWORD) + RtlLengthRequiredSid(5);
+        ULONG acl_size = sizeof(ACL) + ace_size * (ace_count + 1);
+        m_acl = make_unique<char[]>(acl_size);
+        PACL acl = reinterpret_cast<PACL>(m_acl.get());
+        Check(RtlCreateAcl(acl, acl_size, ACL_REVISION));
+        for (int i = 0; i < ace_count; ++i) {
+            Check(RtlAddAccessAllowedAce(acl, ACL_REVISION, GENERIC_READ, MakeUnknownSid(1000 + i).get()));
+        }
+        Check(RtlAddAccessAllowedAce(acl, ACL_REVISION, GENERIC_ALL, world_sid.get()));
+        Check(RtlCreateSecurityDescriptor(&m_sd, SECURITY_DESCRIPTOR_REVISION));
+        Check(RtlSetDaclSecurityDescriptor(&m_sd, TRUE, acl, FALSE));
+    }
+    DirectorySecurity(const DirectorySecurity&) = delete;
+
+    PSECURITY_DESCRIPTOR get() {
+        return &m_sd;
+    }
+
+private:
+    SECURITY_DESCRIPTOR m_sd;
+    unique_ptr<char[]> m_acl;
+};
+
+// Set to apply a security descriptor to every directory created.
+static unique_ptr<DirectorySecurity> g_directory_security;
+
+// Added to the attributes of every object the helpers create or open,
+// OBJ_CASE_INSENSITIVE to compare names case insensitively.
+static ULONG g_case_attributes = 0;
+
+// Set when the kernel's ObCaseInsensitive is on, which is the default. It
+// makes the object types case insensitive, so lookups of directories and
+// events ignore case whether or not OBJ_CASE_INSENSITIVE is passed.
+static bool g_ob_case_insensitive = true;
+
+// Reads the setting ObCaseInsensitive was loaded from at boot, assuming the
+// default if the value isn't there.
+static bool GetObCaseInsensitive() {
+    DWORD value = 1;
+    DWORD size = sizeof(value);
+    if (RegGetValueW(HKEY_LOCAL_MACHINE, L"SYSTEM\\CurrentControlSet\\Control\\Session Manager\\kernel",
+        L"obcaseinsensitive", RRF_RT_REG_DWORD, nullptr, &value, &size) != ERROR_SUCCESS) {
+        return true;
+    }
+    return value != 0;
+}
+
+
+static ScopedHandle CreateDirectory(OBJECT_ATTRIBUTES& obja, HANDLE shadow_dir = nullptr) {
+    if (g_directory_security) {
+        obja.SecurityDescriptor = g_directory_security->get();
+    }
     ScopedHandle handle;
     Check(NtCreateDirectoryObjectEx(handle.ptr(), MAXIMUM_ALLOWED, &obja, shadow_dir, 0));
     return handle;
 }
 
+static ScopedHandle CreateDirectory(const wstring& name, HANDLE root = nullptr, HANDLE shadow_dir = nullptr) {
+    ObjectAttributes obja(name, root, g_case_attributes);
+    return CreateDirectory(obja, shadow_dir);
+}
+
 static ScopedHandle OpenDirectory(const wstring& name, HANDLE root = nullptr) {
-    ObjectAttributes obja(name, root);
+    ObjectAttributes obja(name, root, g_case_attributes);
     ScopedHandle handle;
     Check(NtOpenDirectoryObject(handle.ptr(), MAXIMUM_ALLOWED, &obja));
     return handle;
 }
 
 static ScopedHandle CreateLink(const wstring& name, HANDLE root, const wstring& target) {
-    ObjectAttributes obja(name, root);
+    ObjectAttributes obja(name, root, g_case_attributes);
     UnicodeString target_ustr(target);
     ScopedHandle handle;
     Check(NtCreateSymbolicLinkObject(handle.ptr(), MAXIMUM_ALLOWED, &obja, &target_ustr));
     return handle;
 }
 
+// Opens the event if it already exists, so processes attached to a held
+// namespace can share the target.
 static ScopedHandle CreateEvent(const wstring& name, HANDLE root = nullptr) {
-    ObjectAttributes obja(name, root);
+    ObjectAttributes obja(name, root, OBJ_OPENIF | g_case_attributes);
     ScopedHandle handle;
     Check(NtCreateEvent(handle.ptr(), MAXIMUM_ALLOWED, &obja, NotificationEvent, FALSE));
     return handle;
@@ -190,245 +752,2480 @@ static wstring IntToString(int i) {
     return ss.str();
 }
 
-static double RunTest(const wstring name, int iterations, wstring create_name = L"", HANDLE root = nullptr)
-{
-    if (create_name.empty()) {
-        create_name = name;
+enum class HandleMode {
+    // Keep every handle open until the end of the measurement.
+    KeepAll,
+    // Close each handle straight after it's opened.
+    CloseImmediately,
+    // Keep the last ring_size handles open.
+    Ring,
+};
+
+struct HarnessOptions {
+    HandleMode handle_mode = HandleMode::KeepAll;
+    int ring_size = 0;
+    // Set when the handle mode was given, otherwise each scenario's own is used.
+    bool handle_mode_set = false;
+    // Histogram precision in significant bits.
+    int precision = 7;
+    // Heatmap slice length, zero when no heatmap is being written.
+    double heatmap_interval_ms = 0;
+    // When adaptive, opens continue past the iteration count until the
+    // median's relative confidence interval is below target_ci or the time
+    // budget for the point runs out.
+    bool adaptive = false;
+    double target_ci = 0;
+    double budget_ms = 10000;
+    // Stack sampling interval, zero when not profiling.
+    int profile_interval_ms = 0;
+    // Number of threads opening concurrently.
+    int threads = 1;
+    // Set when the change notify privilege has been disabled so every
+    // directory traversed needs an access check.
+    bool traverse_check = false;
+    // ACEs ahead of the granting ACE in created directories' DACLs.
+    int dir_aces = 0;
+    // Keep the built namespace alive for other processes, or use one kept
+    // alive by another process instead of building it.
+    bool hold_namespace = false;
+    bool attach_namespace = false;
+    // Number of threads building sibling entries.
+    int build_threads = 1;
+    // Open paths relative to their deepest directory, opened once per point.
+    bool prefix_cache = false;
+};
+
+static HarnessOptions g_options;
+
+// A component of a path, pointing into the path's buffer.
+struct NameView {
+    const wchar_t* buffer;
+    size_t length;
+};
+
+// Finds the first backslash in [p, end), or end if there isn't one. Paths
+// are counted strings which can contain NULs, so this never stops at one.
+static const wchar_t* FindSeparator(const wchar_t* p, const wchar_t* end) {
+#if defined(_M_IX86) || defined(_M_X64)
+    const __m128i separator = _mm_set1_epi16(L'\\');
+    while (end - p >= 8) {
+        __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(chars, separator));
+        if (mask != 0) {
+            unsigned long index;
+            _BitScanForward(&index, mask);
+            return p + index / sizeof(wchar_t);
+        }
+        p += 8;
     }
-    ScopedHandle event_handle = CreateEvent(create_name, root);
-    ObjectAttributes obja(name);
-    vector<ScopedHandle> handles;
-    Timer timer;
-    for (int i = 0; i < iterations; ++i) {
-        HANDLE open_handle;
-        Check(NtOpenEvent(&open_handle, MAXIMUM_ALLOWED, &obja));
-        handles.emplace_back(open_handle);
+#endif
+    while (p < end && *p != L'\\') {
+        p++;
     }
-    return timer.GetTime(iterations);
+    return p;
 }
 
-static int GetArg(const vector<string>& args, int index, int def_value) {
-    if (args.size() > index && args[index] != "_") {
-        return atoi(args[index].c_str());
+// Calls func(component, last) for each non-empty component of a path
+// without copying it.
+template<typename Func>
+static void SplitPath(const wchar_t* buffer, size_t length, Func func) {
+    const wchar_t* end = buffer + length;
+    const wchar_t* start = buffer;
+    for (;;) {
+        const wchar_t* separator = FindSeparator(start, end);
+        if (separator > start) {
+            func(NameView{ start, static_cast<size_t>(separator - start) }, separator == end);
+        }
+        if (separator == end) {
+            break;
+        }
+        start = separator + 1;
     }
-    return def_value;
 }
 
-static wstring MakeNullString(int count) {
-    wstring ret;
-    for (int i = 0; i < count; ++i) {
-        ret.push_back(0);
-    }
-    return ret;
+template<typename Func>
+static void SplitPath(const UNICODE_STRING& path, Func func) {
+    SplitPath(path.Buffer, path.Length / sizeof(wchar_t), func);
 }
 
-static wstring MakeCollisionName(int count) {
-    return MakeNullString(count) + L"A";
-}
+// Work the object manager does for one operation, estimated from the shape
+// of the namespace a scenario builds rather than measured, to explain the
+// timings in terms of work done. Every component is assumed to be the first
+// entry scanned in its hash bucket unless the scenario adds colliding
+// entries. Colliding names differ in length so only the matching entry has
+// its characters compared. Directories are only access checked on traversal
+// when traverse checking is enabled, the final object is always checked.
+struct WorkCounters {
+    double components = 0;
+    double hashes = 0;
+    double chars_hashed = 0;
+    double entries_scanned = 0;
+    double chars_compared = 0;
+    double reparses = 0;
+    double shadow_fallbacks = 0;
+    double access_checks = 0;
 
-static void Test1(const vector<string>& args)
-{
-    int iterations = GetArg(args, 0, 1000);
+    // Adds a parse of a path where every component is found directly.
+    void AddPath(const wstring& path) {
+        SplitPath(path.data(), path.size(), [&](NameView component, bool last) {
+            AddComponent(static_cast<double>(component.length), last);
+        });
+    }
 
-    auto test1 = RunTest(L"\\BaseNamedObjects\\{2F2C4C1D-FD52-47CA-BF97-CA72B6CA55F8}", iterations);
-    printf("%.2fus for %d iterations.\n", test1, iterations);
-}
+    void AddComponent(double length, bool last = true) {
+        components++;
+        hashes++;
+        chars_hashed += length;
+        entries_scanned++;
+        chars_compared += length;
+        if (last || g_options.traverse_check) {
+            access_checks++;
+        }
+    }
+};
 
-static void Test2(const vector<string>& args)
-{
-    int iterations = GetArg(args, 0, 1000);
+static const char* const kWorkCounterNames =
+    "components,hashes,chars_hashed,entries_scanned,chars_compared,reparses,shadow_fallbacks,access_checks";
 
-    wstring path;
-    while (path.size() <= 32000) {
-        auto result = RunTest(L"\\BaseNamedObjects\\A" + path, iterations);
-        printf("%zu,%f\n", path.size(), result);
-        path += wstring(500, 'A');
-    }
-}
+struct TestResult {
+    // Number of operations actually measured.
+    int iterations = 0;
+    // Average time in microseconds per open.
+    double time = 0;
+    // Average time in microseconds per close.
+    double close_time = 0;
+    // Latency of each timed operation in nanoseconds.
+    Histogram latency;
+    Heatmap heatmap;
+    // Stacks sampled from the measuring thread when profiling.
+    StackSamples stacks;
+    // Estimated work per operation.
+    WorkCounters work;
+    // Opens which returned the first handle in a new page of the handle
+    // table, and their total time in microseconds.
+    uint64_t table_expansions = 0;
+    double expansion_time = 0;
 
-static void Test3(const vector<string>& args)
-{
-    int iterations = GetArg(args, 0, 1000);
-    int dir_count = GetArg(args, 1, 16000);
+    TestResult()
+        : latency(g_options.precision), heatmap(g_options.heatmap_interval_ms * 1000.0) {}
 
-    ScopedHandle base_dir = OpenDirectory(L"\\BaseNamedObjects");
-    HANDLE last_dir = base_dir.get();
-    vector<ScopedHandle> dirs;
-    for (int i = 0; i < dir_count; i++) {
-        dirs.emplace_back(CreateDirectory(L"A", last_dir));
-        last_dir = dirs.back().get();
-        if ((i % 500) == 0)
-        {
-            auto result = RunTest(GetName(last_dir) + L"\\X", iterations);
-            printf("%d,%f\n", i + 1, result);
-        }
+    void Record(high_resolution_clock::time_point measure_start,
+        high_resolution_clock::time_point start, high_resolution_clock::time_point end) {
+        uint64_t value = duration_cast<nanoseconds>(end - start).count();
+        latency.Record(value);
+        heatmap.Record(duration<double, micro>(start - measure_start).count(), value);
     }
-}
 
-static void Test4(const vector<string>& args)
-{
-    int iterations = GetArg(args, 0, 10);
-    int dir_count = GetArg(args, 1, 16000);
-    int symlink_count = GetArg(args, 2, 63);
+    // Combines the result of another thread measuring the same operation.
+    void Merge(const TestResult& other) {
+        int total = iterations + other.iterations;
+        if (total > 0) {
+            time = (time * iterations + other.time * other.iterations) / total;
+            close_time = (close_time * iterations + other.close_time * other.iterations) / total;
+        }
+        iterations = total;
+        latency.Merge(other.latency);
+        heatmap.Merge(other.heatmap);
+        table_expansions += other.table_expansions;
+        expansion_time += other.expansion_time;
+    }
+};
 
-    ScopedHandle base_dir = OpenDirectory(L"\\BaseNamedObjects");
-    HANDLE last_dir = base_dir.get();
-    vector<ScopedHandle> dirs;
-    for (int i = 0; i < dir_count; i++) {
-        dirs.emplace_back(CreateDirectory(L"A", last_dir));
-        last_dir = dirs.back().get();
+// Finds the highest handle value the process holds by probing values from
+// the bottom of the table until every handle in the count has been seen.
+static uintptr_t GetHighestHandle() {
+    DWORD count = 0;
+    if (!GetProcessHandleCount(GetCurrentProcess(), &count)) {
+        return 0;
     }
-    vector<ScopedHandle> links;
-    wstring last_dir_name = GetName(last_dir);
-    for (int i = 0; i < symlink_count; ++i) {
-        links.emplace_back(CreateLink(IntToString(i), last_dir, last_dir_name + L"\\" + IntToString(i + 1)));
+    uintptr_t highest = 0;
+    // Values up to 2^26 cover the 2^24 handle limit, in case the count changed
+    // underneath.
+    for (uintptr_t value = 4; count > 0 && value < (1 << 26); value += 4) {
+        DWORD flags;
+        if (GetHandleInformation(reinterpret_cast<HANDLE>(value), &flags)) {
+            highest = value;
+            count--;
+        }
     }
-    printf("%f\n", RunTest(links.front().name(), iterations, IntToString(symlink_count), last_dir));
+    return highest;
 }
 
-static void Test5(const vector<string>& args)
-{
-    int iterations = GetArg(args, 0, 1000);
-    int collision_count = GetArg(args, 1, 32000);
+// Spots handles which land in a page of the process handle table which no
+// earlier handle used, meaning the kernel had to expand the table. The NT
+// table is three levels of page sized arrays of two pointer sized entries
+// and handle values are the entry index multiplied by four. The table never
+// shrinks, so there's one tracker for the process which starts from the
+// highest handle held when it's first used and only counts pages above it.
+class HandleTableTracker {
+public:
+    static HandleTableTracker& Get() {
+        static HandleTableTracker tracker;
+        return tracker;
+    }
 
-    ScopedHandle base_dir = CreateDirectory(L"\\BaseNamedObjects\\A");
-    vector<ScopedHandle> dirs;
-    wstring base_dir_name = MakeCollisionName(collision_count);
-    for (int i = 0; i < collision_count; i++) {
-        wstring name = MakeCollisionName(collision_count - i);
-        dirs.emplace_back(CreateDirectory(name, base_dir.get()));
-        if ((i % 500) == 0) {
-            Timer timer;
-            for (int j = 0; j < iterations; ++j) {
-                OpenDirectory(base_dir_name, base_dir.get());
+    bool IsNewPage(HANDLE handle) {
+        uintptr_t page = GetPage(handle);
+        uintptr_t highest = m_highest_page.load();
+        while (page > highest) {
+            if (m_highest_page.compare_exchange_weak(highest, page)) {
+                return true;
             }
-            printf("%d,%f\n", i, timer.GetTime(iterations));
         }
+        return false;
     }
-}
 
-static void Test6(const vector<string>& args)
-{
-    int collision_count = GetArg(args, 0, 32000);
+private:
+    HandleTableTracker()
+        : m_highest_page(GetPage(reinterpret_cast<HANDLE>(GetHighestHandle()))) {}
 
-    vector<wstring> names;
-    for (int i = 0; i < collision_count; i++) {
-        names.push_back(MakeCollisionName(collision_count - i));
+    static uintptr_t GetPage(HANDLE handle) {
+        return (reinterpret_cast<uintptr_t>(handle) / 4) / kEntriesPerPage;
     }
 
-    ScopedHandle base_dir = CreateDirectory(L"\\BaseNamedObjects\\A");
-    vector<ScopedHandle> dirs;
-    Timer timer;
-    for (auto& name : names) {
-        dirs.emplace_back(CreateDirectory(name, base_dir.get()));
-    }
-    printf("%f\n", timer.GetTime(1));
-}
+    static const uintptr_t kEntriesPerPage = 4096 / (2 * sizeof(void*));
+    atomic<uintptr_t> m_highest_page;
+};
 
-static void Test7(const vector<string>& args)
+// Checks every this many opens whether an adaptive measurement is done.
+static const int kAdaptiveCheckInterval = 100;
+
+// Runs the open loop for one thread. How long each handle lives is decided
+// by the handle mode; the handle storage is allocated up front so the open
+// time doesn't include reallocation and closes are timed separately from
+// the opens. In adaptive mode iterations is the minimum number of opens.
+template<typename OpenFunc>
+static TestResult MeasureOpensOnThread(int iterations, OpenFunc& open, high_resolution_clock::time_point measure_start,
+    HandleTableTracker& tracker, SamplingProfiler* profiler)
 {
-    int iterations = GetArg(args, 0, 1000);
-    int dir_count = GetArg(args, 1, 16000);
+    // Closing immediately is a ring of one, where the previous handle is
+    // closed before the next open.
+    bool keep_all = g_options.handle_mode == HandleMode::KeepAll;
+    size_t ring_size = 1;
+    if (g_options.handle_mode == HandleMode::Ring) {
+        ring_size = g_options.ring_size;
+    }
 
+    TestResult result;
+    vector<ScopedHandle> handles;
+    if (keep_all) {
+        handles.reserve(iterations);
+    }
+    else {
+        handles.resize(ring_size);
+    }
+    duration<double, micro> open_time(0);
+    duration<double, micro> close_time(0);
+    auto thread_start = high_resolution_clock::now();
+    int i = 0;
+    for (;; ++i) {
+        if (i >= iterations) {
+            if (!g_options.adaptive) {
+                break;
+            }
+            if ((i % kAdaptiveCheckInterval) == 0) {
+                if (result.latency.GetMedianConfidence() * 100.0 < g_options.target_ci ||
+                    duration<double, milli>(high_resolution_clock::now() - thread_start).count() > g_options.budget_ms) {
+                    break;
+                }
+            }
+        }
+        auto start = high_resolution_clock::now();
+        if (!keep_all) {
+            handles[i % ring_size].reset();
+        }
+        auto closed = high_resolution_clock::now();
+        HANDLE handle = open();
+        auto opened = high_resolution_clock::now();
+        if (keep_all) {
+            handles.emplace_back(handle);
+        }
+        else {
+            handles[i % ring_size].reset(handle);
+        }
+        open_time += opened - closed;
+        close_time += closed - start;
+        result.Record(measure_start, closed, opened);
+        if (tracker.IsNewPage(handle)) {
+            result.table_expansions++;
+            result.expansion_time += duration<double, micro>(opened - closed).count();
+        }
+    }
+    if (profiler) {
+        result.stacks = profiler->Stop();
+    }
+    Timer close_timer;
+    handles.clear();
+    close_time += duration<double, micro>(close_timer.GetTime(1));
+    result.iterations = i;
+    result.time = open_time.count() / i;
+    result.close_time = close_time.count() / i;
+    return result;
+}
+
+// Measures a loop of opens, where open returns a new handle, on the number
+// of threads set in the options. Every open is recorded in the result's
+// latency histogram, merged across the threads. Only the calling thread is
+// profiled.
+template<typename OpenFunc>
+static TestResult MeasureOpens(int iterations, OpenFunc open)
+{
+    BeginPhase("measure");
+    HandleTableTracker& tracker = HandleTableTracker::Get();
+    unique_ptr<SamplingProfiler> profiler;
+    if (g_options.profile_interval_ms > 0) {
+        profiler = make_unique<SamplingProfiler>(g_options.profile_interval_ms);
+    }
+    auto measure_start = high_resolution_clock::now();
+    vector<TestResult> results(g_options.threads);
+    vector<exception_ptr> errors(g_options.threads);
+    vector<thread> threads;
+    for (int t = 1; t < g_options.threads; ++t) {
+        threads.emplace_back([&, t]() {
+            try {
+                results[t] = MeasureOpensOnThread(iterations, open, measure_start, tracker, nullptr);
+            }
+            catch (...) {
+                errors[t] = current_exception();
+            }
+        });
+    }
+    try {
+        results[0] = MeasureOpensOnThread(iterations, open, measure_start, tracker, profiler.get());
+    }
+    catch (...) {
+        errors[0] = current_exception();
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (const auto& error : errors) {
+        if (error) {
+            rethrow_exception(error);
+        }
+    }
+    for (size_t t = 1; t < results.size(); ++t) {
+        results[0].Merge(results[t]);
+    }
+    return results[0];
+}
+
+// Position of opens going round a set of names. Each thread measuring keeps
+// its own position, which starts again from the first name for each new
+// cursor rather than carrying over from an earlier point.
+class RoundRobin {
+public:
+    explicit RoundRobin(size_t size) : m_size(size) {
+        static atomic<uint64_t> last_id;
+        m_id = ++last_id;
+    }
+
+    size_t Next() {
+        thread_local uint64_t id = 0;
+        thread_local size_t next = 0;
+        if (id != m_id) {
+            id = m_id;
+            next = 0;
+        }
+        return next++ % m_size;
+    }
+
+private:
+    size_t m_size;
+    uint64_t m_id;
+};
+
+// Policies for the type of object opened and how names are compared.
+struct EventPolicy {
+    static NTSTATUS Open(HANDLE* handle, POBJECT_ATTRIBUTES obja) {
+        return NtOpenEvent(handle, MAXIMUM_ALLOWED, obja);
+    }
+};
+
+struct DirectoryPolicy {
+    static NTSTATUS Open(HANDLE* handle, POBJECT_ATTRIBUTES obja) {
+        return NtOpenDirectoryObject(handle, MAXIMUM_ALLOWED, obja);
+    }
+};
+
+struct CaseSensitivePolicy {
+    static const ULONG kAttributes = 0;
+};
+
+struct CaseInsensitivePolicy {
+    static const ULONG kAttributes = OBJ_CASE_INSENSITIVE;
+};
+
+// Measures opens of name relative to root, with the open specialized for
+// the policies so the measured loop makes the system call directly.
+template<typename TypePolicy, typename CasePolicy>
+static TestResult MeasureLookups(const wstring& name, HANDLE root, int iterations)
+{
+    ObjectAttributes obja(name, root, CasePolicy::kAttributes);
+    return MeasureOpens(iterations, [&]() {
+        HANDLE open_handle;
+        Check(TypePolicy::Open(&open_handle, &obja));
+        return open_handle;
+    });
+}
+
+enum class LookupType {
+    Event,
+    Directory,
+};
+
+typedef TestResult (*LookupEngine)(const wstring& name, HANDLE root, int iterations);
+
+// Every combination of the policies, indexed by type then case
+// insensitivity, so the choice is made once per point. The case sensitive
+// engines only differ from the insensitive ones when ObCaseInsensitive is
+// off.
+static const LookupEngine kLookupEngines[2][2] = {
+    { MeasureLookups<EventPolicy, CaseSensitivePolicy>, MeasureLookups<EventPolicy, CaseInsensitivePolicy> },
+    { MeasureLookups<DirectoryPolicy, CaseSensitivePolicy>, MeasureLookups<DirectoryPolicy, CaseInsensitivePolicy> },
+};
+
+static TestResult MeasureLookups(LookupType type, const wstring& name, HANDLE root, int iterations)
+{
+    return kLookupEngines[type == LookupType::Directory][g_case_attributes != 0](name, root, iterations);
+}
+
+// Opens the deepest directory on an absolute path, one component at a time
+// relative to the last, so opens of the path can start from it rather than
+// walking from the root. Stops at the last component, the object being
+// opened, or the first which isn't a directory. Returns an empty handle if
+// nothing was skipped, otherwise the directory to open remainder relative to.
+static ScopedHandle OpenDeepestDirectory(const wstring& path, wstring& remainder, int& skipped) {
+    remainder = path;
+    skipped = 0;
+    ScopedHandle dir;
+    if (path.empty() || path[0] != L'\\') {
+        return dir;
+    }
+    vector<NameView> components;
+    SplitPath(path.data(), path.size(), [&](NameView component, bool) {
+        components.push_back(component);
+    });
+    dir = OpenDirectory(L"\\");
+    for (size_t i = 0; i + 1 < components.size(); ++i) {
+        UNICODE_STRING name;
+        name.Buffer = const_cast<wchar_t*>(components[i].buffer);
+        name.Length = name.MaximumLength = static_cast<USHORT>(components[i].length * sizeof(wchar_t));
+        NameViewAttributes obja(name, dir.get(), g_case_attributes);
+        HANDLE handle;
+        if (!NT_SUCCESS(NtOpenDirectoryObject(&handle, MAXIMUM_ALLOWED, &obja))) {
+            break;
+        }
+        dir.reset(handle);
+        remainder.assign(components[i + 1].buffer, path.data() + path.size());
+        skipped++;
+    }
+    if (skipped == 0) {
+        dir.reset();
+    }
+    return dir;
+}
+
+static TestResult RunTest(const wstring name, int iterations, wstring create_name = L"", HANDLE root = nullptr)
+{
+    if (create_name.empty()) {
+        create_name = name;
+    }
+    BeginPhase("target");
+    ScopedHandle event_handle = CreateEvent(create_name, root);
+    wstring open_name = name;
+    ScopedHandle open_root;
+    if (g_options.prefix_cache) {
+        BeginPhase("prefix");
+        int skipped;
+        open_root = OpenDeepestDirectory(name, open_name, skipped);
+        int total = 0;
+        SplitPath(name.data(), name.size(), [&](NameView, bool) {
+            total++;
+        });
+        printf("# prefix cache skipped %d of %d components\n", skipped, total);
+    }
+    return MeasureLookups(LookupType::Event, open_name, open_root.get(), iterations);
+}
+
+static int ParseInt(const string& str) {
+    char* end = nullptr;
+    errno = 0;
+    long value = strtol(str.c_str(), &end, 10);
+    if (str.empty() || *end != 0) {
+        throw ArgException("Invalid number: " + str);
+    }
+    if (errno == ERANGE || value < INT_MIN || value > INT_MAX) {
+        throw ArgException("Number out of range: " + str);
+    }
+    return static_cast<int>(value);
+}
+
+// Expands a sweep specification into the values it covers. The spec is a
+// comma separated list of items, each either a single value or an inclusive
+// range "first..last" with an optional step, ":N" to add N or ":xN" to
+// multiply by N, e.g. "1..65536:x2" or "0..32000:500".
+static vector<int> ParseSweep(const string& spec) {
+    vector<int> values;
+    stringstream ss(spec);
+    string item;
+    while (getline(ss, item, ',')) {
+        size_t range = item.find("..");
+        if (range == string::npos) {
+            values.push_back(ParseInt(item));
+            continue;
+        }
+        int first = ParseInt(item.substr(0, range));
+        string rest = item.substr(range + 2);
+        int step = 1;
+        bool geometric = false;
+        size_t colon = rest.find(':');
+        if (colon != string::npos) {
+            string step_str = rest.substr(colon + 1);
+            rest = rest.substr(0, colon);
+            if (!step_str.empty() && step_str[0] == 'x') {
+                geometric = true;
+                step_str = step_str.substr(1);
+            }
+            step = ParseInt(step_str);
+        }
+        int last = ParseInt(rest);
+        if (geometric ? (step < 2 || first < 1) : step < 1) {
+            throw ArgException("Invalid sweep step: " + item);
+        }
+        for (long long i = first; i <= last; i = geometric ? i * step : i + step) {
+            values.push_back(static_cast<int>(i));
+        }
+    }
+    if (values.empty()) {
+        throw ArgException("Empty sweep: " + spec);
+    }
+    return values;
+}
+
+// Builds the Cartesian product of a list of sweep specifications, each
+// point containing one value per argument.
+static vector<vector<string>> ExpandSweep(const vector<string>& specs) {
+    vector<vector<string>> points(1);
+    for (const auto& spec : specs) {
+        vector<vector<string>> next;
+        for (int value : ParseSweep(spec)) {
+            for (const auto& point : points) {
+                next.push_back(point);
+                next.back().push_back(to_string(value));
+            }
+        }
+        points.swap(next);
+    }
+    return points;
+}
+
+// Parameter values for a single sweep point, keyed by parameter name.
+typedef map<string, string> TestArgs;
+
+static int GetArg(const TestArgs& args, const string& name) {
+    auto it = args.find(name);
+    if (it == args.end()) {
+        throw ArgException("Missing parameter: " + name);
+    }
+    return ParseInt(it->second);
+}
+
+static wstring MakeNullString(int count) {
+    wstring ret;
+    for (int i = 0; i < count; ++i) {
+        ret.push_back(0);
+    }
+    return ret;
+}
+
+static wstring MakeCollisionName(int count) {
+    return MakeNullString(count) + L"A";
+}
+
+// Every collision name is a tail of the longest, so a pool holds just that
+// one and hands out views of it rather than each name being copied, which
+// for tens of thousands of names tens of thousands of characters long
+// would take gigabytes.
+class CollisionNamePool {
+public:
+    explicit CollisionNamePool(int max_count) : m_buffer(MakeCollisionName(max_count)) {}
+    CollisionNamePool(const CollisionNamePool&) = delete;
+
+    // Gets the view of MakeCollisionName(count).
+    UNICODE_STRING Get(int count) const {
+        UNICODE_STRING name;
+        name.Buffer = const_cast<wchar_t*>(m_buffer.data()) + (m_buffer.size() - count - 1);
+        name.Length = name.MaximumLength = static_cast<USHORT>((count + 1) * sizeof(wchar_t));
+        return name;
+    }
+
+    // Prints the pool's size against copies of the names of count
+    // directories named for max_count - i.
+    void PrintSavings(int count) const {
+        uint64_t max_count = m_buffer.size() - 1;
+        uint64_t copies = count * (2 * max_count - count + 3) / 2 * sizeof(wchar_t);
+        printf("# name pool %llu bytes instead of %llu bytes of copies\n",
+            static_cast<unsigned long long>(m_buffer.size() * sizeof(wchar_t)),
+            static_cast<unsigned long long>(copies));
+    }
+
+private:
+    wstring m_buffer;
+};
+
+// Runs func(i) for every i in [0, count) on a number of threads. Each thread
+// starts with an equal contiguous share and when it runs out steals the
+// back half of the largest remaining share, so items of very different cost
+// still balance.
+template<typename Func>
+static void ParallelFor(int count, int threads, Func func)
+{
+    struct Share {
+        mutex lock;
+        int begin = 0;
+        int end = 0;
+    };
+    vector<Share> shares(threads);
+    for (int t = 0; t < threads; ++t) {
+        shares[t].begin = static_cast<int>(static_cast<long long>(count) * t / threads);
+        shares[t].end = static_cast<int>(static_cast<long long>(count) * (t + 1) / threads);
+    }
+
+    // A share with one item left has nothing to give, its owner is about
+    // to take it.
+    auto steal = [&](int t) {
+        int victim = -1;
+        int remaining = 1;
+        for (int v = 0; v < threads; ++v) {
+            lock_guard<mutex> guard(shares[v].lock);
+            if (shares[v].end - shares[v].begin > remaining) {
+                victim = v;
+                remaining = shares[v].end - shares[v].begin;
+            }
+        }
+        if (victim < 0) {
+            return false;
+        }
+        int begin;
+        int end;
+        {
+            lock_guard<mutex> guard(shares[victim].lock);
+            end = shares[victim].end;
+            begin = shares[victim].begin + (end - shares[victim].begin + 1) / 2;
+            if (begin >= end) {
+                // The victim finished in the meantime, look again.
+                return true;
+            }
+            shares[victim].end = begin;
+        }
+        lock_guard<mutex> guard(shares[t].lock);
+        shares[t].begin = begin;
+        shares[t].end = end;
+        return true;
+    };
+
+    mutex error_lock;
+    exception_ptr error;
+    auto worker = [&](int t) {
+        try {
+            for (;;) {
+                int i = -1;
+                {
+                    lock_guard<mutex> guard(shares[t].lock);
+                    if (shares[t].begin < shares[t].end) {
+                        i = shares[t].begin++;
+                    }
+                }
+                if (i >= 0) {
+                    func(i);
+                }
+                else if (!steal(t)) {
+                    break;
+                }
+            }
+        }
+        catch (...) {
+            lock_guard<mutex> guard(error_lock);
+            if (!error) {
+                error = current_exception();
+            }
+        }
+    };
+
+    vector<thread> workers;
+    for (int t = 1; t < threads; ++t) {
+        workers.emplace_back(worker, t);
+    }
+    worker(0);
+    for (auto& thread : workers) {
+        thread.join();
+    }
+    if (error) {
+        rethrow_exception(error);
+    }
+}
+
+// Creates count directories under root named MakeCollisionName(collision_count - i)
+// from a name pool across the build threads. The first ordered names are
+// created in order before the rest, so the first is always at the end of
+// the bucket chain and the others in front of it in turn. The rest are
+// inserted in any order, but as the colliding names all differ in length
+// their order in the chain doesn't change the cost of a lookup of the
+// ordered names, and each handle is stored at its name's index so the
+// result is the same for any number of threads.
+static vector<ScopedHandle> CreateCollisionDirectories(HANDLE root, int collision_count, int count, int ordered = 1)
+{
+    vector<ScopedHandle> dirs(count);
+    if (count == 0) {
+        return dirs;
+    }
+    ordered = min(ordered, count);
+    CollisionNamePool names(collision_count);
+    for (int i = 0; i < ordered; ++i) {
+        NameViewAttributes obja(names.Get(collision_count - i), root, g_case_attributes);
+        dirs[i] = CreateDirectory(obja);
+    }
+    atomic<int> done{ ordered };
+    ParallelFor(count - ordered, g_options.build_threads, [&](int i) {
+        NameViewAttributes obja(names.Get(collision_count - ordered - i), root, g_case_attributes);
+        dirs[ordered + i] = CreateDirectory(obja);
+        ShowProgress(++done, count);
+    });
+    names.PrintSavings(count);
+    return dirs;
+}
+
+static TestResult Test1(const TestArgs& args)
+{
+    int iterations = GetArg(args, "iterations");
+
+    wstring name = L"\\BaseNamedObjects\\{2F2C4C1D-FD52-47CA-BF97-CA72B6CA55F8}";
+    auto result = RunTest(name, iterations);
+    result.work.AddPath(name);
+    BeginPhase("teardown");
+    return result;
+}
+
+static TestResult Test2(const TestArgs& args)
+{
+    int iterations = GetArg(args, "iterations");
+    int length = GetArg(args, "length");
+
+    wstring name = L"\\BaseNamedObjects\\A" + wstring(length, 'A');
+    auto result = RunTest(name, iterations);
+    result.work.AddPath(name);
+    BeginPhase("teardown");
+    return result;
+}
+
+static TestResult Test3(const TestArgs& args)
+{
+    int iterations = GetArg(args, "iterations");
+    int dir_count = GetArg(args, "depth");
+
+    BeginPhase("build");
+    ScopedHandle base_dir = OpenDirectory(L"\\BaseNamedObjects");
+    HANDLE last_dir = base_dir.get();
+    vector<ScopedHandle> dirs;
+    for (int i = 0; i < dir_count; i++) {
+        dirs.emplace_back(CreateDirectory(L"A", last_dir));
+        last_dir = dirs.back().get();
+        ShowProgress(i + 1, dir_count);
+    }
+    wstring name = GetName(last_dir) + L"\\X";
+    auto result = RunTest(name, iterations);
+    result.work.AddPath(name);
+    BeginPhase("teardown");
+    return result;
+}
+
+static TestResult Test4(const TestArgs& args)
+{
+    int iterations = GetArg(args, "iterations");
+    int dir_count = GetArg(args, "depth");
+    int symlink_count = GetArg(args, "symlinks");
+
+    BeginPhase("build");
+    ScopedHandle base_dir = OpenDirectory(L"\\BaseNamedObjects");
+    HANDLE last_dir = base_dir.get();
+    vector<ScopedHandle> dirs;
+    for (int i = 0; i < dir_count; i++) {
+        dirs.emplace_back(CreateDirectory(L"A", last_dir));
+        last_dir = dirs.back().get();
+        ShowProgress(i + 1, dir_count);
+    }
+    BeginPhase("links");
+    vector<ScopedHandle> links;
+    wstring last_dir_name = GetName(last_dir);
+    for (int i = 0; i < symlink_count; ++i) {
+        links.emplace_back(CreateLink(IntToString(i), last_dir, last_dir_name + L"\\" + IntToString(i + 1)));
+    }
+    auto result = RunTest(links.front().name(), iterations, IntToString(symlink_count), last_dir);
+    // Each link is reparsed from the start of its full target path.
+    result.work.AddPath(last_dir_name + L"\\0");
+    for (int i = 0; i < symlink_count; ++i) {
+        result.work.AddPath(last_dir_name + L"\\" + IntToString(i + 1));
+    }
+    result.work.reparses = symlink_count;
+    BeginPhase("teardown");
+    return result;
+}
+
+static TestResult Test5(const TestArgs& args)
+{
+    int iterations = GetArg(args, "iterations");
+    int collision_count = GetArg(args, "name_length");
+    int insert_count = min(GetArg(args, "collisions"), collision_count);
+
+    BeginPhase("build");
+    ScopedHandle base_dir = CreateDirectory(L"\\BaseNamedObjects\\A");
+    wstring base_dir_name = MakeCollisionName(collision_count);
+    vector<ScopedHandle> dirs = CreateCollisionDirectories(base_dir.get(), collision_count, insert_count);
+    auto result = MeasureLookups(LookupType::Directory, base_dir_name, base_dir.get(), iterations);
+    // The name being opened was inserted first so is at the end of the chain.
+    result.work.AddComponent(collision_count + 1);
+    result.work.entries_scanned += insert_count - 1;
+    BeginPhase("teardown");
+    return result;
+}
+
+// NT has no batch insert, every directory create takes the directory lock
+// and checks the chain for a duplicate itself, so only the names are built
+// ahead of the timed creates.
+static TestResult Test6(const TestArgs& args)
+{
+    int collision_count = GetArg(args, "collisions");
+
+    BeginPhase("names");
+    CollisionNamePool pool(collision_count);
+    vector<UNICODE_STRING> names;
+    names.reserve(collision_count);
+    for (int i = 0; i < collision_count; i++) {
+        names.push_back(pool.Get(collision_count - i));
+    }
+    pool.PrintSavings(collision_count);
+
+    ScopedHandle base_dir = CreateDirectory(L"\\BaseNamedObjects\\A");
+    vector<ScopedHandle> dirs;
+    dirs.reserve(names.size());
+    TestResult result;
+    BeginPhase("measure");
+    Timer timer;
+    auto measure_start = high_resolution_clock::now();
+    for (auto& name : names) {
+        auto start = high_resolution_clock::now();
+        NameViewAttributes obja(name, base_dir.get(), g_case_attributes);
+        dirs.emplace_back(CreateDirectory(obja));
+        result.Record(measure_start, start, high_resolution_clock::now());
+    }
+    result.iterations = collision_count;
+    result.time = timer.GetTime(1);
+    // Each insertion checks every colliding entry already in the directory
+    // for a duplicate, none of which have the same length.
+    for (int i = 0; i < collision_count; ++i) {
+        double length = collision_count - i + 1;
+        result.work.components++;
+        result.work.hashes++;
+        result.work.chars_hashed += length;
+        result.work.entries_scanned += i;
+        result.work.access_checks++;
+    }
+    result.work.components /= collision_count;
+    result.work.hashes /= collision_count;
+    result.work.chars_hashed /= collision_count;
+    result.work.entries_scanned /= collision_count;
+    result.work.access_checks /= collision_count;
+    BeginPhase("teardown");
+    Timer close_timer;
+    dirs.clear();
+    result.close_time = close_timer.GetTime(1);
+    return result;
+}
+
+static TestResult Test7(const TestArgs& args)
+{
+    int iterations = GetArg(args, "iterations");
+    int dir_count = GetArg(args, "depth");
+
+    BeginPhase("build");
     wstring dir_name = L"\\BaseNamedObjects\\A";
     ScopedHandle shadow_dir = CreateDirectory(dir_name);
     ScopedHandle target_dir = CreateDirectory(L"A", shadow_dir.get(), shadow_dir.get());
-    for (int i = 0; i < dir_count; i += 500) {
-        wstring open_name = dir_name;
-        for (int j = 0; j < i; j++) {
-            open_name += L"\\A";
+    wstring open_name = dir_name;
+    for (int j = 0; j < dir_count; j++) {
+        open_name += L"\\A";
+    }
+    open_name += L"\\X";
+    auto result = RunTest(open_name, iterations, L"X", shadow_dir.get());
+    // Only the first component under the shadow is found directly, the
+    // target directory is empty so the rest fall back to the shadow.
+    result.work.AddPath(open_name);
+    result.work.shadow_fallbacks = dir_count;
+    BeginPhase("teardown");
+    return result;
+}
+
+// Gets the work of one open in Test8. Every parse of the deep path looks up
+// the target directory in the shadow, scanning past all the collisions, and
+// all but the first component fall back from the target to the shadow.
+static WorkCounters GetFullTestWork(int dir_count, int symlink_count, int collision_count)
+{
+    wstring last_dir_name = L"\\BaseNamedObjects\\A";
+    for (int i = 0; i < dir_count; i++) {
+        last_dir_name += L"\\A";
+    }
+    WorkCounters work;
+    for (int i = 0; i <= symlink_count; ++i) {
+        work.AddPath(last_dir_name + L"\\" + IntToString(i));
+        work.entries_scanned += static_cast<double>(dir_count) * (collision_count - 1);
+        work.shadow_fallbacks += dir_count;
+    }
+    work.reparses = symlink_count;
+    return work;
+}
+
+// Waits while another process attaches to the namespace this one built.
+// Kernel objects only live while a handle is open so the namespace lasts as
+// long as this process holds it.
+static void HoldNamespace() {
+    fprintf(stderr, "Holding namespace, press enter to release.\n");
+    getchar();
+}
+
+// Namespace a scenario keeps between its points, such as the fork
+// scenario's base, along with the parameter it was built for. It's
+// released when the scenario's run ends.
+struct ScenarioCache {
+    int key = -1;
+    ScopedHandle dir;
+    vector<ScopedHandle> entries;
+
+    void Clear() {
+        entries.clear();
+        dir.reset();
+        key = -1;
+    }
+};
+
+static ScenarioCache g_scenario_cache;
+
+// Forks a directory copy-on-write style: the fork is a new empty directory
+// with base as its shadow, so any name not added to the fork is looked up in
+// base. A variant only creates the entries it adds, everything else is
+// shared with base.
+static ScopedHandle ForkDirectory(const wstring& name, HANDLE base) {
+    return CreateDirectory(name, nullptr, base);
+}
+
+static TestResult Test8(const TestArgs& args)
+{
+    int iterations = GetArg(args, "iterations");
+    int dir_count = GetArg(args, "depth");
+    int symlink_count = GetArg(args, "symlinks");
+    int collision_count = GetArg(args, "collisions");
+
+    wstring dir_name = L"\\BaseNamedObjects\\A";
+    wstring last_dir_name = dir_name;
+
+    for (int i = 0; i < dir_count; i++) {
+        last_dir_name += L"\\A";
+    }
+
+    ScopedHandle shadow_dir;
+    ScopedHandle target_dir;
+    vector<ScopedHandle> dirs;
+    vector<ScopedHandle> links;
+    if (g_options.attach_namespace) {
+        // The held namespace must have been built with the same parameters.
+        BeginPhase("attach");
+        shadow_dir = OpenDirectory(dir_name);
+    }
+    else {
+        BeginPhase("build");
+        shadow_dir = CreateDirectory(dir_name);
+        target_dir = CreateDirectory(L"A", shadow_dir.get(), shadow_dir.get());
+        dirs = CreateCollisionDirectories(shadow_dir.get(), collision_count, collision_count - 1);
+
+        BeginPhase("links");
+        for (int i = 0; i < symlink_count; ++i) {
+            links.emplace_back(CreateLink(IntToString(i), shadow_dir.get(), last_dir_name + L"\\" + IntToString(i + 1)));
+        }
+
+        if (g_options.hold_namespace) {
+            BeginPhase("hold");
+            HoldNamespace();
+        }
+    }
+
+    auto result = RunTest(last_dir_name + L"\\0", iterations, IntToString(symlink_count), shadow_dir.get());
+    result.work = GetFullTestWork(dir_count, symlink_count, collision_count);
+    BeginPhase("teardown");
+    return result;
+}
+
+static TestResult Test9(const TestArgs& args)
+{
+    int iterations = GetArg(args, "iterations");
+    int base_collisions = GetArg(args, "base_collisions");
+    int extra_collisions = min(GetArg(args, "extra_collisions"), 32766 - base_collisions);
+    int symlink_count = GetArg(args, "symlinks");
+
+    // The base is only rebuilt when its shape changes, every point forks it.
+    ScenarioCache& base = g_scenario_cache;
+    if (base.key != base_collisions) {
+        BeginPhase("base");
+        base.Clear();
+        base.dir = CreateDirectory(L"\\BaseNamedObjects\\ForkBase");
+        base.entries = CreateCollisionDirectories(base.dir.get(), base_collisions, base_collisions);
+        base.key = base_collisions;
+    }
+
+    // The extra collisions are longer than any name in the base so the
+    // target, the first name inserted in the base, is never found in the fork.
+    BeginPhase("fork");
+    wstring fork_name = L"\\BaseNamedObjects\\Fork";
+    wstring target_name = MakeCollisionName(base_collisions);
+    ScopedHandle fork_dir = ForkDirectory(fork_name, base.dir.get());
+    CollisionNamePool names(base_collisions + extra_collisions);
+    vector<ScopedHandle> extra;
+    for (int i = 0; i < extra_collisions; ++i) {
+        NameViewAttributes obja(names.Get(base_collisions + i + 1), fork_dir.get(), g_case_attributes);
+        extra.emplace_back(CreateDirectory(obja));
+        ShowProgress(i + 1, extra_collisions);
+    }
+    vector<ScopedHandle> links;
+    for (int i = 0; i < symlink_count; ++i) {
+        wstring link_target = fork_name + L"\\" + (i + 1 < symlink_count ? IntToString(i + 1) : target_name);
+        links.emplace_back(CreateLink(IntToString(i), fork_dir.get(), link_target));
+    }
+
+    auto result = MeasureLookups(LookupType::Directory, symlink_count > 0 ? L"0" : target_name, fork_dir.get(), iterations);
+    // The target misses in the fork, scanning the extra collisions, then
+    // falls back to the end of the base's chain.
+    for (int i = 0; i < symlink_count; ++i) {
+        result.work.AddPath(i == 0 ? IntToString(i) : fork_name + L"\\" + IntToString(i));
+    }
+    if (symlink_count > 0) {
+        result.work.AddPath(fork_name);
+    }
+    result.work.AddComponent(base_collisions + 1);
+    result.work.entries_scanned += extra_collisions + base_collisions - 1;
+    result.work.shadow_fallbacks = 1;
+    result.work.reparses = symlink_count;
+    BeginPhase("teardown");
+    return result;
+}
+
+static TestResult Test10(const TestArgs& args)
+{
+    int iterations = GetArg(args, "iterations");
+    int length = GetArg(args, "length");
+    // Keep the path within the longest UNICODE_STRING.
+    int component_count = min(GetArg(args, "components"), 32767 / (length + 1));
+
+    BeginPhase("build");
+    wstring component = GetArg(args, "nul") ? MakeNullString(length) : wstring(length, L'A');
+    wstring path;
+    for (int i = 0; i < component_count; ++i) {
+        path += L"\\" + component;
+    }
+    UnicodeString path_ustr(path);
+
+    // Splitting a short path takes less time than reading the clock, so
+    // only the total is timed.
+    BeginPhase("measure");
+    TestResult result;
+    size_t total = 0;
+    Timer timer;
+    for (int i = 0; i < iterations; ++i) {
+        SplitPath(path_ustr, [&](NameView name, bool) {
+            total += name.length;
+        });
+    }
+    result.time = timer.GetTime(iterations);
+    result.iterations = iterations;
+    // Keeps the splits from being optimized away.
+    static volatile size_t sink;
+    sink = total;
+    if (result.time > 0) {
+        printf("# components/s %.0f\n", component_count / result.time * 1000000.0);
+    }
+    result.work.components = component_count;
+    result.work.chars_hashed = static_cast<double>(component_count) * length;
+    BeginPhase("teardown");
+    return result;
+}
+
+static TestResult Test11(const TestArgs& args)
+{
+    int iterations = GetArg(args, "iterations");
+    int collision_count = GetArg(args, "collisions");
+    int batch = min(GetArg(args, "batch"), collision_count);
+
+    BeginPhase("build");
+    ScopedHandle base_dir = CreateDirectory(L"\\BaseNamedObjects\\A");
+    // The batch is the first names inserted, in order at the end of the chain.
+    vector<ScopedHandle> dirs = CreateCollisionDirectories(base_dir.get(), collision_count, collision_count, batch);
+    CollisionNamePool names(collision_count);
+    vector<unique_ptr<NameViewAttributes>> targets;
+    for (int b = 0; b < batch; ++b) {
+        targets.emplace_back(make_unique<NameViewAttributes>(names.Get(collision_count - b),
+            base_dir.get(), g_case_attributes));
+    }
+    // Each open is a single system call so lookups can't be interleaved,
+    // instead the opens go round the batch.
+    RoundRobin cursor(targets.size());
+    auto result = MeasureOpens(iterations, [&]() {
+        HANDLE open_handle;
+        Check(NtOpenDirectoryObject(&open_handle, MAXIMUM_ALLOWED, targets[cursor.Next()].get()));
+        return open_handle;
+    });
+    // On average the batch's names are half the batch from the end of the chain.
+    result.work.AddComponent(collision_count + 1 - (batch - 1) / 2.0);
+    result.work.entries_scanned += collision_count - 1 - (batch - 1) / 2.0;
+    BeginPhase("teardown");
+    return result;
+}
+
+static const ULONG kDirectoryBuckets = 37;
+
+// The object manager's hash of a name. Each entry keeps its full hash and a
+// lookup only compares the names of entries in the bucket whose hash
+// matches, the bucket is the hash modulo the number of buckets.
+static ULONG HashName(const wstring& name) {
+    ULONG hash = 0;
+    for (wchar_t c : name) {
+        hash += (hash << 1) + (hash >> 1);
+        hash += static_cast<ULONG>(towupper(c));
+    }
+    return hash;
+}
+
+enum class BucketLayout {
+    // Names spread evenly across every bucket.
+    Spread,
+    // Names in the same bucket with different hashes.
+    SameBucket,
+    // Names of the same length with the same hash, the same up to the end.
+    SameHash,
+};
+
+// Makes count names for a layout, the first being the one opened. SameHash
+// names are made of blocks of "AH" and "CA", which leave the hash the same,
+// counting in binary in their last blocks.
+static vector<wstring> MakeBucketNames(BucketLayout layout, int count, int length) {
+    vector<wstring> names;
+    if (layout == BucketLayout::SameHash) {
+        int bits = HighestBit(count) + 1;
+        int blocks = max(bits, (length + 1) / 2);
+        for (int i = 0; i < count; ++i) {
+            wstring name;
+            for (int b = blocks - 1; b >= 0; --b) {
+                name += (b < bits && (i >> b) & 1) ? L"CA" : L"AH";
+            }
+            names.push_back(name);
+        }
+        return names;
+    }
+    // Numbered names, padded to the length.
+    auto make_name = [&](int i) {
+        wstring number = IntToString(i);
+        return wstring(number.size() < static_cast<size_t>(length) ? length - number.size() : 0, L'A') + number;
+    };
+    ULONG target_bucket = HashName(make_name(0)) % kDirectoryBuckets;
+    vector<int> bucket_counts(kDirectoryBuckets);
+    int per_bucket = (count + kDirectoryBuckets - 1) / kDirectoryBuckets;
+    for (int i = 0; static_cast<int>(names.size()) < count; ++i) {
+        wstring name = make_name(i);
+        ULONG bucket = HashName(name) % kDirectoryBuckets;
+        if (layout == BucketLayout::SameBucket ? bucket == target_bucket : bucket_counts[bucket] < per_bucket) {
+            bucket_counts[bucket]++;
+            names.push_back(name);
+        }
+    }
+    return names;
+}
+
+static TestResult Test12(const TestArgs& args)
+{
+    int iterations = GetArg(args, "iterations");
+    int count = GetArg(args, "entries");
+    BucketLayout layout = static_cast<BucketLayout>(GetArg(args, "layout"));
+    int length = GetArg(args, "length");
+
+    BeginPhase("names");
+    vector<wstring> names = MakeBucketNames(layout, count, length);
+
+    BeginPhase("build");
+    ScopedHandle base_dir = CreateDirectory(L"\\BaseNamedObjects\\A");
+    vector<ScopedHandle> dirs;
+    for (size_t i = 0; i < names.size(); ++i) {
+        dirs.emplace_back(CreateDirectory(names[i], base_dir.get()));
+        ShowProgress(static_cast<int>(i + 1), count);
+    }
+    auto result = MeasureLookups(LookupType::Directory, names[0], base_dir.get(), iterations);
+    // The name opened was inserted first so is at the end of its bucket's
+    // chain. Only entries with the same hash have their names compared, up
+    // to the first character which differs.
+    const wstring& target = names[0];
+    ULONG hash = HashName(target);
+    result.work.AddComponent(static_cast<double>(target.size()));
+    for (size_t i = 1; i < names.size(); ++i) {
+        ULONG other_hash = HashName(names[i]);
+        if (other_hash % kDirectoryBuckets != hash % kDirectoryBuckets) {
+            continue;
+        }
+        result.work.entries_scanned++;
+        if (other_hash == hash && names[i].size() == target.size()) {
+            auto common = mismatch(target.begin(), target.end(), names[i].begin());
+            result.work.chars_compared += static_cast<double>(common.first - target.begin()) + 1;
+        }
+    }
+    BeginPhase("teardown");
+    return result;
+}
+
+// Makes a name for a synthetic namespace, random characters of about the
+// length followed by the index to keep it unique among its siblings. The
+// BaseNamedObjects profile makes half the names GUIDs. Names are at most
+// twice the length, so with the length up to 250 and the depth up to 64 the
+// deepest path fits in a UNICODE_STRING.
+static wstring MakeSyntheticName(mt19937& rng, int index, bool directory, int name_length, bool bno) {
+    static const wchar_t kChars[] = L"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_-";
+    static const wchar_t kHex[] = L"0123456789ABCDEF";
+    wstring unique = IntToString(index) + (directory ? L"d" : L"e");
+    wstring name;
+    if (bno && rng() % 2 == 0) {
+        name = L"{";
+        for (int i = 0; i < 24; ++i) {
+            name += (i == 8 || i == 13 || i == 18 || i == 23) ? L'-' : kHex[rng() % 16];
+        }
+        unique.insert(0, 12 - min(unique.size(), static_cast<size_t>(12)), L'0');
+        return name + unique + L"}";
+    }
+    int length = uniform_int_distribution<int>(1, 2 * name_length - 1)(rng);
+    for (int i = static_cast<int>(unique.size()) + 1; i < length; ++i) {
+        name += kChars[rng() % (_countof(kChars) - 1)];
+    }
+    return name + L"." + unique;
+}
+
+static TestResult Test13(const TestArgs& args)
+{
+    int iterations = GetArg(args, "iterations");
+    int object_count = GetArg(args, "objects");
+    size_t fanout = GetArg(args, "fanout");
+    int depth = GetArg(args, "depth");
+    int name_length = GetArg(args, "name_length");
+    bool bno = GetArg(args, "profile") != 0;
+    mt19937 rng(GetArg(args, "seed"));
+
+    // Each object is put at a random depth, taking a random path down the
+    // directories and adding a directory wherever one has fewer than fanout
+    // subdirectories. The BaseNamedObjects profile puts nearly everything
+    // in the top directory.
+    // Where each name went, its directory, hash bucket and how many names
+    // were already in that bucket, to count the entries a lookup scans.
+    struct Entry {
+        size_t dir;
+        ULONG bucket;
+        int ordinal;
+    };
+    struct Node {
+        ScopedHandle dir;
+        wstring path;
+        vector<size_t> children;
+        array<int, kDirectoryBuckets> bucket_sizes{};
+        Entry entry;
+    };
+    BeginPhase("build");
+    int64_t pool_start = GetMemoryUsage().pool();
+    vector<Node> nodes(1);
+    nodes[0].path = L"\\BaseNamedObjects\\Synthetic";
+    nodes[0].dir = CreateDirectory(nodes[0].path);
+    vector<ScopedHandle> objects;
+    vector<wstring> paths;
+    vector<Entry> entries;
+    objects.reserve(object_count);
+    paths.reserve(object_count);
+    entries.reserve(object_count);
+    auto add_entry = [&](size_t dir, const wstring& name) {
+        ULONG bucket = HashName(name) % kDirectoryBuckets;
+        return Entry{ dir, bucket, nodes[dir].bucket_sizes[bucket]++ };
+    };
+    for (int i = 0; i < object_count; ++i) {
+        int level = bno ? (rng() % 20 == 0 ? 1 : 0) : uniform_int_distribution<int>(0, depth)(rng);
+        size_t node = 0;
+        for (int l = 0; l < level; ++l) {
+            if (nodes[node].children.size() < fanout) {
+                Node child;
+                wstring name = MakeSyntheticName(rng, static_cast<int>(nodes.size()), true, name_length, bno);
+                child.path = nodes[node].path + L"\\" + name;
+                child.dir = CreateDirectory(name, nodes[node].dir.get());
+                child.entry = add_entry(node, name);
+                nodes[node].children.push_back(nodes.size());
+                nodes.push_back(move(child));
+                node = nodes.size() - 1;
+            }
+            else {
+                node = nodes[node].children[rng() % fanout];
+            }
+        }
+        wstring name = MakeSyntheticName(rng, i, false, name_length, bno);
+        objects.emplace_back(CreateEvent(name, nodes[node].dir.get()));
+        entries.push_back(add_entry(node, name));
+        paths.push_back(nodes[node].path + L"\\" + name);
+        ShowProgress(i + 1, object_count);
+    }
+    int64_t pool_used = GetMemoryUsage().pool() - pool_start;
+
+    // The opens go round a random sample of the objects. Names are added at
+    // the head of their bucket's chain, so a lookup of each component in
+    // the synthetic tree scans every name added to its bucket after it.
+    BeginPhase("lookups");
+    vector<unique_ptr<ObjectAttributes>> lookups;
+    WorkCounters work;
+    int lookup_count = min(object_count, 4096);
+    for (int i = 0; i < lookup_count; ++i) {
+        size_t object = rng() % paths.size();
+        lookups.emplace_back(make_unique<ObjectAttributes>(paths[object], nullptr, g_case_attributes));
+        work.AddPath(paths[object]);
+        for (Entry entry = entries[object];; entry = nodes[entry.dir].entry) {
+            work.entries_scanned += nodes[entry.dir].bucket_sizes[entry.bucket] - entry.ordinal - 1;
+            if (entry.dir == 0) {
+                break;
+            }
+        }
+    }
+    RoundRobin cursor(lookups.size());
+    auto result = MeasureOpens(iterations, [&]() {
+        HANDLE open_handle;
+        Check(NtOpenEvent(&open_handle, MAXIMUM_ALLOWED, lookups[cursor.Next()].get()));
+        return open_handle;
+    });
+    for (double* counter : { &work.components, &work.hashes, &work.chars_hashed, &work.entries_scanned,
+        &work.chars_compared, &work.access_checks }) {
+        *counter /= lookup_count;
+    }
+    result.work = work;
+    size_t object_total = objects.size() + nodes.size();
+    printf("# objects %zu directories %zu pool_bytes_per_object %.1f opens/s %.0f\n", object_total, nodes.size(),
+        static_cast<double>(pool_used) / object_total, result.time > 0 ? 1000000.0 / result.time : 0.0);
+    BeginPhase("teardown");
+    return result;
+}
+
+// Gets the pool charged for creating count objects with create(i), which
+// are kept until the end of the measurement.
+template<typename CreateFunc>
+static double GetPoolPerObject(const char* phase, int count, CreateFunc create)
+{
+    BeginPhase(phase);
+    vector<ScopedHandle> handles;
+    handles.reserve(count);
+    int64_t start = GetMemoryUsage().pool();
+    for (int i = 0; i < count; ++i) {
+        handles.emplace_back(create(i));
+        ShowProgress(i + 1, count);
+    }
+    return static_cast<double>(GetMemoryUsage().pool() - start) / count;
+}
+
+static TestResult Test14(const TestArgs& args)
+{
+    int count = GetArg(args, "count");
+    int name_length = GetArg(args, "name_length");
+
+    // Each kind of object differs from the one before by one unit of
+    // memory, an unnamed event is just the object, naming it adds an entry
+    // and a short name, a longer name adds characters, a directory swaps
+    // the event for a directory and a handle is another open of the event.
+    ScopedHandle base_dir = CreateDirectory(L"\\BaseNamedObjects\\A");
+    double unnamed = GetPoolPerObject("unnamed", count, [&](int) {
+        OBJECT_ATTRIBUTES obja;
+        InitializeObjectAttributes(&obja, nullptr, 0, nullptr, nullptr);
+        ScopedHandle handle;
+        Check(NtCreateEvent(handle.ptr(), MAXIMUM_ALLOWED, &obja, NotificationEvent, FALSE));
+        return handle;
+    });
+    double short_chars = 0;
+    double named = GetPoolPerObject("named", count, [&](int i) {
+        wstring name = IntToString(i);
+        short_chars += name.size();
+        return CreateEvent(name, base_dir.get());
+    });
+    short_chars /= count;
+    double long_named = GetPoolPerObject("long_named", count, [&](int i) {
+        wstring name = IntToString(i);
+        name.insert(0, max(name_length - static_cast<int>(name.size()), 0), L'A');
+        return CreateEvent(name, base_dir.get());
+    });
+    double directory = GetPoolPerObject("directories", count, [&](int i) {
+        return CreateDirectory(IntToString(i), base_dir.get());
+    });
+    ScopedHandle event_handle = CreateEvent(L"Handle", base_dir.get());
+    ObjectAttributes obja(L"Handle", base_dir.get(), g_case_attributes);
+    Timer timer;
+    double handle = GetPoolPerObject("handles", count, [&](int) {
+        ScopedHandle handle;
+        Check(NtOpenEvent(handle.ptr(), MAXIMUM_ALLOWED, &obja));
+        return handle;
+    });
+
+    TestResult result;
+    result.iterations = count;
+    result.time = timer.GetTime(count);
+    double per_char = name_length > short_chars ? (long_named - named) / (name_length - short_chars) : 0;
+    printf("# bytes_per_event %.1f bytes_per_directory %.1f bytes_per_entry %.1f bytes_per_name_char %.1f"
+        " bytes_per_handle %.1f\n", unnamed, directory - named + unnamed, named - unnamed - short_chars * per_char,
+        per_char, handle);
+    BeginPhase("teardown");
+    return result;
+}
+
+// Names each writer cycles through and how many of them it keeps at once.
+static const int kWriterNames = 32;
+static const int kWriterLive = 16;
+
+// Raises the system timer resolution to a millisecond while it's held, so
+// short sleeps wake close to on time.
+class TimerResolution {
+public:
+    TimerResolution() {
+        timeBeginPeriod(1);
+    }
+    ~TimerResolution() {
+        timeEndPeriod(1);
+    }
+    TimerResolution(const TimerResolution&) = delete;
+};
+
+// Waits until time or stop is set, sleeping for all but the last
+// millisecond so a paced thread doesn't take a core from the measurement,
+// then spinning for the rest to be on time.
+static void WaitUntil(high_resolution_clock::time_point time, const atomic<bool>& stop) {
+    const auto spin = milliseconds(1);
+    const auto max_sleep = milliseconds(10);
+    while (!stop) {
+        auto now = high_resolution_clock::now();
+        if (now >= time) {
+            return;
+        }
+        if (time - now > spin) {
+            auto sleep = time - now - spin;
+            this_thread::sleep_for(sleep < max_sleep ? sleep : max_sleep);
+        }
+        else {
+            YieldProcessor();
         }
-        open_name += L"\\X";
-        printf("%d,%f\n", i, RunTest(open_name, iterations, L"X", shadow_dir.get()));
     }
 }
 
-static void Test8(const vector<string>& args)
+static TestResult Test15(const TestArgs& args)
 {
-    int iterations = GetArg(args, 0, 1000);
-    int dir_count = GetArg(args, 1, 16000);
-    int symlink_count = GetArg(args, 2, 1);
-    int collision_count = GetArg(args, 3, 16000);
+    int iterations = GetArg(args, "iterations");
+    int collision_count = GetArg(args, "collisions");
+    int hot_count = min(GetArg(args, "hot"), collision_count);
+    int writer_count = min(GetArg(args, "writers"), (32766 - collision_count) / kWriterNames);
+    int write_rate = GetArg(args, "write_rate");
 
-    wstring dir_name = L"\\BaseNamedObjects\\A";
-    ScopedHandle shadow_dir = CreateDirectory(dir_name);
-    ScopedHandle target_dir = CreateDirectory(L"A", shadow_dir.get(), shadow_dir.get());
-    vector<ScopedHandle> dirs;
-    for (int i = 0; i < collision_count - 1; ++i) {
-        dirs.emplace_back(CreateDirectory(MakeCollisionName(collision_count - i), shadow_dir.get()));
+    BeginPhase("build");
+    ScopedHandle base_dir = CreateDirectory(L"\\BaseNamedObjects\\A");
+    // The readers open the first names inserted, in order at the end of the
+    // chain, and the writers' names are longer so they collide with all of them.
+    vector<ScopedHandle> dirs = CreateCollisionDirectories(base_dir.get(), collision_count, collision_count, hot_count);
+    CollisionNamePool names(collision_count + writer_count * kWriterNames);
+    vector<unique_ptr<NameViewAttributes>> hot;
+    for (int i = 0; i < hot_count; ++i) {
+        hot.emplace_back(make_unique<NameViewAttributes>(names.Get(collision_count - i), base_dir.get(),
+            g_case_attributes));
     }
 
-    wstring last_dir_name = dir_name;
+    // Each writer creates a directory and deletes the one it created
+    // kWriterLive creates before by closing it, spacing its creates evenly
+    // to share write_rate or as fast as it can when write_rate is zero.
+    unique_ptr<TimerResolution> resolution;
+    if (writer_count > 0 && write_rate > 0) {
+        resolution = make_unique<TimerResolution>();
+    }
+    atomic<bool> stop{ false };
+    atomic<uint64_t> writes{ 0 };
+    vector<exception_ptr> errors(writer_count);
+    vector<thread> writers;
+    for (int w = 0; w < writer_count; ++w) {
+        writers.emplace_back([&, w]() {
+            try {
+                vector<ScopedHandle> live(kWriterLive);
+                auto interval = write_rate ? duration<double>(static_cast<double>(writer_count) / write_rate)
+                    : duration<double>(0);
+                auto next = high_resolution_clock::now();
+                for (uint64_t j = 0; !stop; ++j) {
+                    if (write_rate) {
+                        next += duration_cast<high_resolution_clock::duration>(interval);
+                        WaitUntil(next, stop);
+                    }
+                    int name = collision_count + 1 + w * kWriterNames + static_cast<int>(j % kWriterNames);
+                    NameViewAttributes obja(names.Get(name), base_dir.get(), g_case_attributes);
+                    live[j % kWriterLive] = CreateDirectory(obja);
+                    writes++;
+                }
+            }
+            catch (...) {
+                errors[w] = current_exception();
+            }
+        });
+    }
 
-    for (int i = 0; i < dir_count; i++) {
-        last_dir_name += L"\\A";
+    Timer timer;
+    TestResult result;
+    try {
+        RoundRobin cursor(hot.size());
+        result = MeasureOpens(iterations, [&]() {
+            HANDLE open_handle;
+            Check(NtOpenDirectoryObject(&open_handle, MAXIMUM_ALLOWED, hot[cursor.Next()].get()));
+            return open_handle;
+        });
+    }
+    catch (...) {
+        stop = true;
+        for (auto& writer : writers) {
+            writer.join();
+        }
+        throw;
     }
+    stop = true;
+    double elapsed = timer.GetTime(1);
+    for (auto& writer : writers) {
+        writer.join();
+    }
+    for (const auto& error : errors) {
+        if (error) {
+            rethrow_exception(error);
+        }
+    }
+    printf("# writer ops/s %.0f\n", elapsed > 0 ? writes * 1000000.0 / elapsed : 0.0);
+    // The hot names are on average half the hot set from the end of the
+    // chain, behind every writer's live entries.
+    result.work.AddComponent(collision_count + 1 - (hot_count - 1) / 2.0);
+    result.work.entries_scanned += collision_count - 1 - (hot_count - 1) / 2.0 + writer_count * kWriterLive;
+    BeginPhase("teardown");
+    return result;
+}
 
-    printf("Created directories\n");
-    vector<ScopedHandle> links;
-    for (int i = 0; i < symlink_count; ++i) {
-        links.emplace_back(CreateLink(IntToString(i), shadow_dir.get(), last_dir_name + L"\\" + IntToString(i + 1)));
+struct TestParam {
+    const char* name;
+    // Default value, can be any sweep specification.
+    const char* def;
+    int min_value;
+    int max_value;
+    const char* description;
+};
+
+struct TestScenario {
+    int number;
+    const char* name;
+    const char* description;
+    TestResult (*func)(const TestArgs& args);
+    vector<TestParam> params;
+    // Handle mode used unless one is given.
+    HandleMode handle_mode = HandleMode::KeepAll;
+};
+
+static const TestParam kIterations = { "iterations", "1000", 1, 100000000, "Number of opens per point" };
+
+static const TestScenario g_scenarios[] = {
+    { 1, "open", "Simple open.", Test1, { kIterations } },
+    { 2, "name_length", "Incrementing length name string.", Test2, {
+        kIterations,
+        { "length", "0..32000:500", 0, 32748, "Characters appended to the name" } } },
+    { 3, "depth", "Recursive directories.", Test3, {
+        kIterations,
+        { "depth", "1..15501:500", 1, 16370, "Number of nested directories" } } },
+    { 4, "symlinks", "Recursive symlinks.", Test4, {
+        { "iterations", "10", 1, 100000000, "Number of opens per point" },
+        { "depth", "16000", 1, 16370, "Number of nested directories" },
+        { "symlinks", "63", 1, 64, "Length of the symbolic link chain" } } },
+    { 5, "collisions", "Name collisions.", Test5, {
+        kIterations,
+        { "name_length", "32000", 1, 32766, "Length of the name being opened" },
+        { "collisions", "1..31501:500", 1, 32766, "Colliding names inserted before the open" } },
+        HandleMode::CloseImmediately },
+    { 6, "insertion", "Collision insertion time.", Test6, {
+        { "collisions", "32000", 1, 32766, "Colliding names to insert" } } },
+    { 7, "shadow", "Shadow directories.", Test7, {
+        kIterations,
+        { "depth", "0..15500:500", 0, 16370, "Path components resolved through the shadow" } } },
+    { 8, "full", "Full test.", Test8, {
+        { "iterations", "1", 1, 100000000, "Number of opens per point" },
+        { "depth", "16000", 0, 16370, "Path components resolved through the shadow" },
+        { "symlinks", "1", 1, 64, "Length of the symbolic link chain" },
+        { "collisions", "16000", 1, 32766, "Colliding names in the shadow directory" } } },
+    { 9, "fork", "Forked collision directory.", Test9, {
+        kIterations,
+        { "base_collisions", "16000", 1, 32765, "Colliding names in the shared base directory" },
+        { "extra_collisions", "0..16000:1000", 0, 32765, "Colliding names added to the fork" },
+        { "symlinks", "0", 0, 63, "Symbolic links added to the fork in front of the target" } } },
+    { 10, "tokenize", "Path splitting.", Test10, {
+        { "iterations", "100000", 1, 100000000, "Number of splits per point" },
+        { "components", "1,16,256,4096,16000", 1, 32767, "Path components" },
+        { "length", "1", 1, 32766, "Characters in each component" },
+        { "nul", "0", 0, 1, "Use NUL characters in the components" } } },
+    { 11, "batch", "Batched collision lookups.", Test11, {
+        kIterations,
+        { "collisions", "16000", 1, 32766, "Colliding names in the directory" },
+        { "batch", "1,2,4,8,16,32,64", 1, 64, "Distinct names opened in turn" } } },
+    { 12, "buckets", "Directory bucket layout.", Test12, {
+        kIterations,
+        { "entries", "16000", 1, 1000000, "Entries in the directory" },
+        { "layout", "0,1,2", 0, 2, "0 spread over the buckets, 1 same bucket, 2 same hash" },
+        { "length", "16", 1, 1024, "Minimum name length" } } },
+    { 13, "synthetic", "Synthetic namespace.", Test13, {
+        kIterations,
+        { "objects", "10000,100000,1000000", 1, 10000000, "Objects in the namespace" },
+        { "fanout", "16", 1, 100000, "Subdirectories per directory" },
+        { "depth", "4", 0, 64, "Deepest level of directories" },
+        { "name_length", "16", 1, 250, "Mean name length" },
+        { "profile", "0,1", 0, 1, "0 uniform depth and name length, 1 like BaseNamedObjects" },
+        { "seed", "1", 0, 2147483647, "Seed for the namespace's shape" } } },
+    { 14, "memory", "Memory per object.", Test14, {
+        { "count", "10000", 1, 1000000, "Objects of each kind to create" },
+        { "name_length", "256", 1, 32767, "Characters in the long names" } } },
+    { 15, "churn", "Lookups during creates and deletes.", Test15, {
+        kIterations,
+        { "collisions", "64,16000", 1, 32766, "Colliding names in the directory" },
+        { "hot", "16", 1, 32766, "Names the readers open in turn" },
+        { "writers", "0,1,2,4", 0, 64, "Threads creating and deleting colliding names" },
+        { "write_rate", "0,1000,10000,100000", 0, 100000000, "Creates per second across the writers, 0 for no limit" } } },
+};
+
+static void ParseHandleMode(const string& mode) {
+    g_options.handle_mode_set = true;
+    if (mode == "keep") {
+        g_options.handle_mode = HandleMode::KeepAll;
+    }
+    else if (mode == "close") {
+        g_options.handle_mode = HandleMode::CloseImmediately;
+    }
+    else if (mode.rfind("ring:", 0) == 0) {
+        g_options.handle_mode = HandleMode::Ring;
+        g_options.ring_size = ParseInt(mode.substr(5));
+        if (g_options.ring_size < 1) {
+            throw ArgException("Invalid ring size: " + mode);
+        }
+    }
+    else {
+        throw ArgException("Unknown handle mode: " + mode);
+    }
+}
+
+static string FormatHandleMode() {
+    switch (g_options.handle_mode) {
+    case HandleMode::CloseImmediately:
+        return "close";
+    case HandleMode::Ring:
+        return "ring:" + to_string(g_options.ring_size);
+    default:
+        return "keep";
+    }
+}
+
+struct RunOptions {
+    bool ordered = false;
+    unsigned seed = 0;
+    vector<string> positional;
+    vector<pair<string, string>> params;
+    // Heatmap and folded stack outputs, if enabled.
+    FILE* heatmap_fp = nullptr;
+    FILE* profile_fp = nullptr;
+    // Search for the slowest point rather than sweeping, for at most
+    // search_s seconds.
+    bool search = false;
+    double search_s = 600;
+};
+
+static bool GlobMatch(const char* pattern, const char* str) {
+    if (*pattern == 0) {
+        return *str == 0;
+    }
+    if (*pattern == '*') {
+        return GlobMatch(pattern + 1, str) || (*str != 0 && GlobMatch(pattern, str + 1));
+    }
+    if (*str != 0 && (*pattern == '?' || *pattern == *str)) {
+        return GlobMatch(pattern + 1, str + 1);
+    }
+    return false;
+}
+
+static vector<const TestScenario*> FindScenarios(const string& pattern) {
+    vector<const TestScenario*> ret;
+    for (const auto& scenario : g_scenarios) {
+        if (to_string(scenario.number) == pattern || GlobMatch(pattern.c_str(), scenario.name)) {
+            ret.push_back(&scenario);
+        }
+    }
+    return ret;
+}
+
+// Resolves the sweep specification of each parameter of a scenario from the
+// defaults, the positional arguments and any --param overrides, checking
+// every value against the declared range. If user_set is provided it's
+// filled with whether each parameter was given on the command line.
+static vector<string> ResolveParams(const TestScenario& scenario, const RunOptions& options,
+    vector<bool>* user_set = nullptr) {
+    const auto& params = scenario.params;
+    if (options.positional.size() > params.size()) {
+        throw ArgException("Too many arguments for " + string(scenario.name) + ".");
+    }
+    vector<string> specs;
+    vector<bool> set(params.size());
+    for (size_t i = 0; i < params.size(); ++i) {
+        specs.push_back(params[i].def);
+        if (i < options.positional.size() && options.positional[i] != "_") {
+            specs[i] = options.positional[i];
+            set[i] = true;
+        }
+    }
+    for (const auto& param : options.params) {
+        auto it = find_if(params.begin(), params.end(),
+            [&](const TestParam& p) { return param.first == p.name; });
+        if (it != params.end()) {
+            specs[it - params.begin()] = param.second;
+            set[it - params.begin()] = true;
+        }
+    }
+    if (user_set) {
+        *user_set = set;
+    }
+    for (size_t i = 0; i < params.size(); ++i) {
+        for (int value : ParseSweep(specs[i])) {
+            if (value < params[i].min_value || value > params[i].max_value) {
+                stringstream ss;
+                ss << "Parameter " << params[i].name << " value " << value << " outside range "
+                    << params[i].min_value << ".." << params[i].max_value << ".";
+                throw ArgException(ss.str());
+            }
+        }
+    }
+    return specs;
+}
+
+// Records the resolved parameters and harness options as comments, followed
+// by the CSV header.
+static void PrintHeader(const TestScenario& scenario, const vector<string>& specs) {
+    printf("# scenario %s\n", scenario.name);
+    for (size_t i = 0; i < specs.size(); ++i) {
+        printf("# %s=%s\n", scenario.params[i].name, specs[i].c_str());
+    }
+    printf("# handles=%s threads=%d%s\n", FormatHandleMode().c_str(), g_options.threads,
+        g_options.adaptive && scenario.handle_mode == HandleMode::KeepAll && !g_options.handle_mode_set ?
+        " (closed instead of kept, adaptive)" : "");
+    printf("# traverse_check=%d dir_aces=%d prefix_cache=%d case_insensitive=%d obcaseinsensitive=%d\n",
+        g_options.traverse_check, g_options.dir_aces, g_options.prefix_cache, g_case_attributes != 0,
+        g_ob_case_insensitive);
+    if (g_options.adaptive) {
+        printf("# adaptive ci=%g%% budget=%gms\n", g_options.target_ci, g_options.budget_ms);
+    }
+    for (const auto& param : scenario.params) {
+        printf("%s,", param.name);
+    }
+    printf("samples,time,close_time,p50,p90,p99,p99.9,max,table_expansions,expansion_time,%s\n", kWorkCounterNames);
+}
+
+// Prints a comment with the wall time of each phase, followed by one per
+// phase with the change in memory over it in KB and the peak at its end.
+static void PrintPhases() {
+    printf("# phases");
+    for (const auto& phase : g_phases.phases()) {
+        printf(" %s=%.1fms", phase.name, phase.ms);
+    }
+    printf("\n");
+    for (const auto& phase : g_phases.phases()) {
+        const MemoryUsage& start = phase.start;
+        const MemoryUsage& end = phase.end;
+        printf("# memory %s working_set=%+lld private=%+lld paged_pool=%+lld nonpaged_pool=%+lld"
+            " heap_allocated=%+lld heap_committed=%+lld peak_working_set=%lld\n", phase.name,
+            (end.working_set - start.working_set) / 1024, (end.private_bytes - start.private_bytes) / 1024,
+            (end.paged_pool - start.paged_pool) / 1024, (end.nonpaged_pool - start.nonpaged_pool) / 1024,
+            (end.heap_allocated - start.heap_allocated) / 1024, (end.heap_committed - start.heap_committed) / 1024,
+            end.peak_working_set / 1024);
+    }
+}
+
+// Releases anything the scenario kept between its points, timed as a phase
+// of its own.
+static void ReleaseScenario() {
+    if (g_scenario_cache.key < 0) {
+        return;
+    }
+    g_phases.Clear();
+    BeginPhase("release");
+    g_scenario_cache.Clear();
+    g_phases.End();
+    PrintPhases();
+    fflush(stdout);
+}
+
+// Runs a single point and prints its row tagged with the parameter values,
+// giving the average times and a table of latency percentiles in
+// microseconds, followed by a comment with the wall time of each phase of
+// the point. The point's latency heatmap and sampled stacks are appended to
+// their outputs if enabled.
+static TestResult RunPoint(const TestScenario& scenario, const vector<string>& point, const RunOptions& options)
+{
+    TestArgs args;
+    for (size_t i = 0; i < point.size(); ++i) {
+        args[scenario.params[i].name] = point[i];
+    }
+    g_phases.Clear();
+    BeginPhase("setup");
+    TestResult result = scenario.func(args);
+    g_phases.End();
+    for (const auto& value : point) {
+        printf("%s,", value.c_str());
+    }
+    printf("%d,%f,%f", result.iterations, result.time, result.close_time);
+    for (double percentile : { 50.0, 90.0, 99.0, 99.9, 100.0 }) {
+        printf(",%f", result.latency.GetPercentile(percentile) / 1000.0);
+    }
+    printf(",%llu,%f", static_cast<unsigned long long>(result.table_expansions),
+        result.table_expansions ? result.expansion_time / result.table_expansions : 0.0);
+    const WorkCounters& work = result.work;
+    printf(",%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f", work.components, work.hashes, work.chars_hashed,
+        work.entries_scanned, work.chars_compared, work.reparses, work.shadow_fallbacks, work.access_checks);
+    printf("\n");
+    PrintPhases();
+    fflush(stdout);
+    if (options.heatmap_fp) {
+        string tag = scenario.name;
+        for (size_t i = 0; i < point.size(); ++i) {
+            tag += string(i ? ";" : ",") + scenario.params[i].name + "=" + point[i];
+        }
+        result.heatmap.Write(options.heatmap_fp, tag);
+    }
+    if (options.profile_fp) {
+        string tag = scenario.name;
+        for (size_t i = 0; i < point.size(); ++i) {
+            tag += string(i ? "," : "(") + scenario.params[i].name + "=" + point[i];
+        }
+        WriteFoldedStacks(options.profile_fp, tag + ")", result.stacks);
+    }
+    return result;
+}
+
+// Uses the scenario's handle mode unless one was given. An adaptive point
+// can run for its whole time budget, so rather than keeping every handle
+// it closes each one after opening it.
+static void SelectHandleMode(const TestScenario& scenario) {
+    if (!g_options.handle_mode_set) {
+        g_options.handle_mode = scenario.handle_mode;
+    }
+    if (g_options.adaptive && g_options.handle_mode == HandleMode::KeepAll) {
+        g_options.handle_mode = HandleMode::CloseImmediately;
+    }
+}
+
+// Runs every point in the Cartesian product of the scenario's parameters.
+// Points are run in a random order unless ordered is set so that slow drift
+// in the system isn't mistaken for a trend in the results.
+static void RunScenario(const TestScenario& scenario, const RunOptions& options)
+{
+    SelectHandleMode(scenario);
+    auto specs = ResolveParams(scenario, options);
+    auto points = ExpandSweep(specs);
+
+    PrintHeader(scenario, specs);
+    if (!options.ordered) {
+        shuffle(points.begin(), points.end(), mt19937(options.seed));
+        printf("# seed %u\n", options.seed);
+    }
+    for (const auto& point : points) {
+        RunPoint(scenario, point, options);
+    }
+    ReleaseScenario();
+}
+
+// Gets the values to search for a parameter the user didn't set, the
+// declared range as a geometric series ending at the maximum.
+static vector<int> GetSearchDomain(const TestParam& param) {
+    vector<int> values;
+    if (param.min_value == 0) {
+        values.push_back(0);
+    }
+    for (long long value = max(param.min_value, 1); value < param.max_value; value *= 2) {
+        values.push_back(static_cast<int>(value));
+    }
+    values.push_back(param.max_value);
+    return values;
+}
+
+// Searches for the point with the slowest time per operation by coordinate
+// descent. Each parameter's values are those of its sweep if the user set
+// one, otherwise its whole declared range as a geometric series, except the
+// iteration count which stays at its default. Each step moves one
+// parameter up or down its values, halving the step when neither direction
+// is slower, until no step is left or the time budget runs out. Ranges given
+// on the command line bound the resources a point can use.
+static void SearchScenario(const TestScenario& scenario, const RunOptions& options)
+{
+    SelectHandleMode(scenario);
+    vector<bool> user_set;
+    auto specs = ResolveParams(scenario, options, &user_set);
+    vector<vector<int>> domains;
+    vector<size_t> current;
+    vector<size_t> steps;
+    for (size_t i = 0; i < specs.size(); ++i) {
+        const TestParam& param = scenario.params[i];
+        vector<int> domain = ParseSweep(specs[i]);
+        if (!user_set[i] && string(param.name) != "iterations") {
+            domain = GetSearchDomain(param);
+        }
+        sort(domain.begin(), domain.end());
+        domain.erase(unique(domain.begin(), domain.end()), domain.end());
+        // Start from the default where it's in the domain.
+        int start = ParseSweep(param.def).front();
+        auto it = lower_bound(domain.begin(), domain.end(), start);
+        current.push_back(it == domain.end() ? domain.size() - 1 : it - domain.begin());
+        steps.push_back(domain.size() / 4 > 0 ? domain.size() / 4 : 1);
+        if (domain.size() == 1) {
+            steps.back() = 0;
+        }
+        domains.push_back(domain);
+    }
+
+    PrintHeader(scenario, specs);
+    printf("# search budget=%gs\n", options.search_s);
+    auto search_start = high_resolution_clock::now();
+    map<vector<size_t>, double> evaluated;
+    auto evaluate = [&](const vector<size_t>& indexes) {
+        auto it = evaluated.find(indexes);
+        if (it != evaluated.end()) {
+            return it->second;
+        }
+        vector<string> point;
+        for (size_t i = 0; i < indexes.size(); ++i) {
+            point.push_back(to_string(domains[i][indexes[i]]));
+        }
+        double time = RunPoint(scenario, point, options).time;
+        evaluated[indexes] = time;
+        return time;
+    };
+    auto out_of_time = [&]() {
+        return duration<double>(high_resolution_clock::now() - search_start).count() > options.search_s;
+    };
+
+    double best = evaluate(current);
+    bool stepping = true;
+    while (stepping && !out_of_time()) {
+        stepping = false;
+        for (size_t i = 0; i < domains.size() && !out_of_time(); ++i) {
+            if (steps[i] == 0) {
+                continue;
+            }
+            stepping = true;
+            bool improved = false;
+            for (int direction : { 1, -1 }) {
+                vector<size_t> candidate = current;
+                long long index = static_cast<long long>(current[i]) + direction * static_cast<long long>(steps[i]);
+                candidate[i] = static_cast<size_t>(max(0ll, min(index, static_cast<long long>(domains[i].size()) - 1)));
+                if (candidate[i] == current[i]) {
+                    continue;
+                }
+                double time = evaluate(candidate);
+                if (time > best) {
+                    best = time;
+                    current = candidate;
+                    improved = true;
+                    break;
+                }
+            }
+            if (!improved) {
+                steps[i] /= 2;
+            }
+        }
+    }
+
+    printf("# slowest");
+    for (size_t i = 0; i < domains.size(); ++i) {
+        printf(" %s=%d", scenario.params[i].name, domains[i][current[i]]);
+    }
+    printf(" time=%f points=%zu\n", best, evaluated.size());
+    ReleaseScenario();
+}
+
+// A result row read back for fitting the cost model.
+struct ModelRow {
+    string scenario;
+    double time;
+    WorkCounters work;
+};
+
+// The work terms the model fits a cost to, the first being a fixed cost per
+// operation.
+static const char* const kModelTerms[] = {
+    "fixed", "components", "entries_scanned", "chars_compared", "reparses", "shadow_fallbacks"
+};
+
+static vector<double> GetModelTerms(const WorkCounters& work) {
+    return { 1.0, work.components, work.entries_scanned, work.chars_compared, work.reparses, work.shadow_fallbacks };
+}
+
+// Reads the result rows from a file of results, skipping Test6's insertion
+// rows as their time isn't per operation, the tokenize rows as their time
+// is splitting the path in user mode rather than a lookup, and the memory
+// rows as they count no work. Rows run with the prefix cache are skipped
+// too, as their work counts the whole path while the timed open only walks
+// its last components, and so are churn rows with writers, whose time
+// includes waiting for the directory lock.
+static vector<ModelRow> ReadModelRows(const string& path) {
+    ifstream file(path);
+    if (!file) {
+        throw ArgException("Can't open results file: " + path);
+    }
+    vector<ModelRow> rows;
+    string scenario;
+    bool prefix_cache = false;
+    map<string, size_t> columns;
+    string line;
+    while (getline(file, line)) {
+        if (line.rfind("# scenario ", 0) == 0) {
+            scenario = line.substr(11);
+            prefix_cache = false;
+            columns.clear();
+            continue;
+        }
+        if (line.rfind("# traverse_check=", 0) == 0) {
+            prefix_cache = line.find(" prefix_cache=1") != string::npos;
+            continue;
+        }
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        vector<string> fields;
+        stringstream ss(line);
+        string field;
+        while (getline(ss, field, ',')) {
+            fields.push_back(field);
+        }
+        if (columns.empty()) {
+            for (size_t i = 0; i < fields.size(); ++i) {
+                columns[fields[i]] = i;
+            }
+            continue;
+        }
+        if (scenario == "insertion" || scenario == "tokenize" || scenario == "memory" || prefix_cache) {
+            continue;
+        }
+        auto get = [&](const char* name) {
+            auto it = columns.find(name);
+            if (it == columns.end() || it->second >= fields.size()) {
+                throw ArgException("Missing column " + string(name) + " in " + path);
+            }
+            return atof(fields[it->second].c_str());
+        };
+        if (scenario == "churn" && get("writers") > 0) {
+            continue;
+        }
+        ModelRow row;
+        row.scenario = scenario;
+        row.time = get("time");
+        row.work.components = get("components");
+        row.work.entries_scanned = get("entries_scanned");
+        row.work.chars_compared = get("chars_compared");
+        row.work.reparses = get("reparses");
+        row.work.shadow_fallbacks = get("shadow_fallbacks");
+        if (row.time > 0) {
+            rows.push_back(row);
+        }
+    }
+    return rows;
+}
+
+// Fits the cost of each term by least squares on the relative error, as the
+// times span several orders of magnitude. A small ridge term keeps the
+// solution stable when terms are collinear, such as components and
+// characters compared in the deep path tests.
+static vector<double> FitCostModel(const vector<ModelRow>& rows) {
+    const size_t n = _countof(kModelTerms);
+    vector<vector<double>> a(n, vector<double>(n + 1));
+    for (const auto& row : rows) {
+        auto terms = GetModelTerms(row.work);
+        double weight = 1.0 / (row.time * row.time);
+        for (size_t i = 0; i < n; ++i) {
+            for (size_t j = 0; j < n; ++j) {
+                a[i][j] += weight * terms[i] * terms[j];
+            }
+            a[i][n] += weight * terms[i] * row.time;
+        }
+    }
+    for (size_t i = 0; i < n; ++i) {
+        a[i][i] += 1e-9 * a[i][i] + 1e-12;
+    }
+    // Gaussian elimination with partial pivoting.
+    for (size_t col = 0; col < n; ++col) {
+        size_t pivot = col;
+        for (size_t row = col + 1; row < n; ++row) {
+            if (fabs(a[row][col]) > fabs(a[pivot][col])) {
+                pivot = row;
+            }
+        }
+        swap(a[col], a[pivot]);
+        for (size_t row = 0; row < n; ++row) {
+            if (row != col && a[col][col] != 0) {
+                double factor = a[row][col] / a[col][col];
+                for (size_t k = col; k <= n; ++k) {
+                    a[row][k] -= factor * a[col][k];
+                }
+            }
+        }
+    }
+    vector<double> costs(n);
+    for (size_t i = 0; i < n; ++i) {
+        costs[i] = a[i][i] != 0 ? a[i][n] / a[i][i] : 0;
+    }
+    return costs;
+}
+
+static double PredictTime(const vector<double>& costs, const WorkCounters& work) {
+    auto terms = GetModelTerms(work);
+    double time = 0;
+    for (size_t i = 0; i < costs.size(); ++i) {
+        time += costs[i] * terms[i];
+    }
+    return time;
+}
+
+// Prints the RMS relative error of the model for each scenario in rows.
+static void PrintModelError(const char* label, const vector<double>& costs, const vector<ModelRow>& rows) {
+    map<string, pair<double, size_t>> errors;
+    for (const auto& row : rows) {
+        double error = (PredictTime(costs, row.work) - row.time) / row.time;
+        errors[row.scenario].first += error * error;
+        errors[row.scenario].second++;
+    }
+    for (const auto& error : errors) {
+        printf("# %s error scenario=%s rows=%zu rms=%.1f%%\n", label, error.first.c_str(), error.second.second,
+            100.0 * sqrt(error.second.first / error.second.second));
+    }
+}
+
+// Checks every parameter set by name belongs to one of the scenarios.
+static void CheckParams(const vector<const TestScenario*>& scenarios, const RunOptions& options) {
+    for (const auto& param : options.params) {
+        bool found = false;
+        for (auto scenario : scenarios) {
+            for (const auto& p : scenario->params) {
+                found |= param.first == p.name;
+            }
+        }
+        if (!found) {
+            throw ArgException("Unknown parameter: " + param.first);
+        }
+    }
+}
+
+// Fits a per-operation cost to each unit of work from the result files in
+// paths, then predicts the full test's time at the points given by the
+// options' parameters. Full test rows in the results are held out of the fit
+// to measure the prediction error.
+static void RunModel(const vector<string>& paths, const RunOptions& options) {
+    vector<ModelRow> fit_rows;
+    vector<ModelRow> full_rows;
+    for (const auto& path : paths) {
+        for (const auto& row : ReadModelRows(path)) {
+            (row.scenario == "full" ? full_rows : fit_rows).push_back(row);
+        }
+    }
+    if (fit_rows.size() < _countof(kModelTerms)) {
+        throw ArgException("Not enough result rows to fit the model.");
+    }
+
+    auto costs = FitCostModel(fit_rows);
+    printf("# model fitted from %zu rows\n", fit_rows.size());
+    printf("term,cost_us\n");
+    for (size_t i = 0; i < costs.size(); ++i) {
+        printf("%s,%g\n", kModelTerms[i], costs[i]);
+    }
+    PrintModelError("fit", costs, fit_rows);
+    PrintModelError("prediction", costs, full_rows);
+
+    const TestScenario& full = *FindScenarios("full").front();
+    auto specs = ResolveParams(full, options);
+    printf("depth,symlinks,collisions,predicted_time\n");
+    for (const auto& point : ExpandSweep(specs)) {
+        TestArgs args;
+        for (size_t i = 0; i < point.size(); ++i) {
+            args[full.params[i].name] = point[i];
+        }
+        int depth = GetArg(args, "depth");
+        int symlinks = GetArg(args, "symlinks");
+        int collisions = GetArg(args, "collisions");
+        printf("%d,%d,%d,%f\n", depth, symlinks, collisions,
+            PredictTime(costs, GetFullTestWork(depth, symlinks, collisions)));
     }
+}
 
-    printf("%f\n", RunTest(last_dir_name + L"\\0", 1, IntToString(symlink_count), shadow_dir.get()));
+static void PrintScenarios() {
+    for (const auto& scenario : g_scenarios) {
+        printf("%d %s: %s\n", scenario.number, scenario.name, scenario.description);
+        for (const auto& param : scenario.params) {
+            printf("    %-12s %-14s [%d..%d] %s\n", param.name, param.def,
+                param.min_value, param.max_value, param.description);
+        }
+    }
 }
 
 static void PrintHelp() {
-    printf("Specify test:\n");
-    printf("1 = Simple open.\n");
-    printf("2 = Incrementing length name string.\n");
-    printf("3 = Recursive directories.\n");
-    printf("4 = Recursive symlinks.\n");
-    printf("5 = Name collisions.\n");
-    printf("6 = Collision insertion time.\n");
-    printf("7 = Shadow directories.\n");
-    printf("8 = Full test.\n");
+    printf("Usage: ObjectNameLookup [options] scenario [values...]\n");
+    printf("       ObjectNameLookup model results... [--param name=value]\n");
+    printf("The scenario is a number, name or glob. Values are assigned to the\n");
+    printf("parameters in order, use _ to keep the default.\n");
+    printf("The model command fits the cost of each unit of lookup work from saved\n");
+    printf("results and predicts the full test's time for its parameters.\n");
+    printf("Any value can be a sweep: a list \"1,2,5\", a range \"0..32000:500\"\n");
+    printf("or a geometric series \"1..65536:x2\".\n");
+    printf("Options:\n");
+    printf("--list             List scenarios and their parameters.\n");
+    printf("--param name=value Set a parameter by name.\n");
+    printf("--ordered          Run sweep points in order rather than shuffled.\n");
+    printf("--seed=N           Seed for the sweep order.\n");
+    printf("--handles=MODE     Opened handle lifetime: keep, close or ring:K to keep\n");
+    printf("                   the last K handles open. The default is close for\n");
+    printf("                   collisions and keep for the rest.\n");
+    printf("--threads=N        Open from N threads concurrently (default 1).\n");
+    printf("--traverse-check   Disable the change notify privilege so traversed\n");
+    printf("                   directories are access checked.\n");
+    printf("--dir-aces=N       Add N unmatched ACEs to created directories' DACLs.\n");
+    printf("--search           Search for the slowest point instead of sweeping.\n");
+    printf("--search-s=N       Time budget for the search in seconds (default 600).\n");
+    printf("--hold             Keep the full test's namespace alive after building\n");
+    printf("                   it until enter is pressed.\n");
+    printf("--attach           Use the full test namespace held by another process.\n");
+    printf("--build-threads=N  Create colliding directories on N threads (default 1).\n");
+    printf("--case-insensitive Create and open names case insensitively. Only differs from\n");
+    printf("                   the default when obcaseinsensitive is 0 in the registry.\n");
+    printf("--prefix-cache     Open each point's deepest directory once and open the\n");
+    printf("                   rest of the path relative to it. The work columns\n");
+    printf("                   still count the whole path, so model skips these.\n");
+    printf("--ci=PERCENT       Keep opening until the median's 95%% confidence\n");
+    printf("                   interval is within PERCENT, iterations is the minimum.\n");
+    printf("                   Handles are closed rather than kept when adaptive.\n");
+    printf("--budget-ms=N      Time budget per point when adaptive (default 10000).\n");
+    printf("--profile=FILE     Sample the measuring thread's stack and write folded\n");
+    printf("                   stacks for each point.\n");
+    printf("--profile-ms=N     Approximate sampling interval (default 1).\n");
+    printf("--precision=N      Latency histogram precision in bits (default 7).\n");
+    printf("--heatmap=FILE     Write a latency heatmap CSV for each point.\n");
+    printf("--heatmap-ms=N     Heatmap time slice in milliseconds (default 10).\n");
+    printf("Scenarios:\n");
+    for (const auto& scenario : g_scenarios) {
+        printf("%d = %s (%s)\n", scenario.number, scenario.description, scenario.name);
+    }
 }
 
 int main(int argc, char** argv) {
-    if (argc < 2) {
-        PrintHelp();
-        return 1;
-    }
+    RunOptions options;
+    options.seed = random_device()();
+    string pattern;
+    string heatmap_path;
+    double heatmap_interval_ms = 10;
+    string profile_path;
+    int profile_interval_ms = 1;
 
     try {
-        int test_no = atoi(argv[1]);
-        vector<string> args(&argv[2], &argv[argc]);
+        for (int i = 1; i < argc; ++i) {
+            string arg = argv[i];
+            if (arg == "--list") {
+                PrintScenarios();
+                return 0;
+            }
+            else if (arg == "--ordered") {
+                options.ordered = true;
+            }
+            else if (arg.rfind("--seed=", 0) == 0) {
+                options.seed = strtoul(arg.c_str() + 7, nullptr, 0);
+            }
+            else if (arg.rfind("--handles=", 0) == 0) {
+                ParseHandleMode(arg.substr(10));
+            }
+            else if (arg.rfind("--threads=", 0) == 0) {
+                g_options.threads = ParseInt(arg.substr(10));
+                if (g_options.threads < 1) {
+                    throw ArgException("Invalid thread count: " + arg);
+                }
+            }
+            else if (arg == "--case-insensitive") {
+                g_case_attributes = OBJ_CASE_INSENSITIVE;
+            }
+            else if (arg == "--prefix-cache") {
+                g_options.prefix_cache = true;
+            }
+            else if (arg == "--traverse-check") {
+                g_options.traverse_check = true;
+            }
+            else if (arg.rfind("--dir-aces=", 0) == 0) {
+                g_options.dir_aces = ParseInt(arg.substr(11));
+                if (g_options.dir_aces < 0 || g_options.dir_aces > 1000) {
+                    throw ArgException("Invalid ACE count: " + arg);
+                }
+            }
+            else if (arg == "--search") {
+                options.search = true;
+            }
+            else if (arg.rfind("--search-s=", 0) == 0) {
+                options.search_s = atof(arg.c_str() + 11);
+                if (options.search_s <= 0) {
+                    throw ArgException("Invalid search budget: " + arg);
+                }
+            }
+            else if (arg == "--hold") {
+                g_options.hold_namespace = true;
+            }
+            else if (arg == "--attach") {
+                g_options.attach_namespace = true;
+            }
+            else if (arg.rfind("--build-threads=", 0) == 0) {
+                g_options.build_threads = ParseInt(arg.substr(16));
+                if (g_options.build_threads < 1) {
+                    throw ArgException("Invalid build thread count: " + arg);
+                }
+            }
+            else if (arg.rfind("--ci=", 0) == 0) {
+                g_options.adaptive = true;
+                g_options.target_ci = atof(arg.c_str() + 5);
+                if (g_options.target_ci <= 0) {
+                    throw ArgException("Invalid confidence interval: " + arg);
+                }
+            }
+            else if (arg.rfind("--budget-ms=", 0) == 0) {
+                g_options.adaptive = true;
+                g_options.budget_ms = atof(arg.c_str() + 12);
+                if (g_options.budget_ms <= 0) {
+                    throw ArgException("Invalid time budget: " + arg);
+                }
+            }
+            else if (arg.rfind("--precision=", 0) == 0) {
+                g_options.precision = ParseInt(arg.substr(12));
+                if (g_options.precision < 1 || g_options.precision > 16) {
+                    throw ArgException("Invalid precision: " + arg);
+                }
+            }
+            else if (arg.rfind("--heatmap=", 0) == 0) {
+                heatmap_path = arg.substr(10);
+            }
+            else if (arg.rfind("--heatmap-ms=", 0) == 0) {
+                heatmap_interval_ms = atof(arg.c_str() + 13);
+                if (heatmap_interval_ms <= 0) {
+                    throw ArgException("Invalid heatmap interval: " + arg);
+                }
+            }
+            else if (arg.rfind("--profile=", 0) == 0) {
+                profile_path = arg.substr(10);
+            }
+            else if (arg.rfind("--profile-ms=", 0) == 0) {
+                profile_interval_ms = ParseInt(arg.substr(13));
+                if (profile_interval_ms < 1) {
+                    throw ArgException("Invalid profile interval: " + arg);
+                }
+            }
+            else if (arg == "--param" && i + 1 < argc) {
+                string param = argv[++i];
+                size_t equals = param.find('=');
+                if (equals == string::npos) {
+                    throw ArgException("Invalid parameter: " + param);
+                }
+                options.params.emplace_back(param.substr(0, equals), param.substr(equals + 1));
+            }
+            else if (arg.rfind("--", 0) == 0) {
+                throw ArgException("Unknown option: " + arg);
+            }
+            else if (pattern.empty()) {
+                pattern = arg;
+            }
+            else {
+                options.positional.push_back(arg);
+            }
+        }
 
-        switch (test_no) {
-        case 1:
-            Test1(args);
-            break;
-        case 2:
-            Test2(args);
-            break;
-        case 3:
-            Test3(args);
-            break;
-        case 4:
-            Test4(args);
-            break;
-        case 5:
-            Test5(args);
-            break;
-        case 6:
-            Test6(args);
-            break;
-        case 7:
-            Test7(args);
-            break;
-        case 8:
-            Test8(args);
-            break;
-        default:
-            printf("Unknown test: %d.\n", test_no);
+        if (g_options.adaptive && g_options.handle_mode_set && g_options.handle_mode == HandleMode::KeepAll) {
+            throw ArgException("Adaptive runs can't keep every handle, use --handles=close or ring:K.");
+        }
+
+        if (pattern.empty()) {
             PrintHelp();
             return 1;
         }
+
+        if (pattern == "model") {
+            // The positional arguments are result files rather than the
+            // full test's parameters, which can only be set by name.
+            CheckParams(FindScenarios("full"), options);
+            vector<string> paths;
+            paths.swap(options.positional);
+            RunModel(paths, options);
+            return 0;
+        }
+
+        g_ob_case_insensitive = GetObCaseInsensitive();
+        if (g_ob_case_insensitive && !g_case_attributes) {
+            fprintf(stderr, "obcaseinsensitive is set, so names are compared case insensitively even without "
+                "--case-insensitive.\n");
+        }
+
+        if (g_options.traverse_check) {
+            BOOLEAN enabled;
+            Check(RtlAdjustPrivilege(kChangeNotifyPrivilege, FALSE, FALSE, &enabled));
+        }
+        if (g_options.dir_aces > 0) {
+            g_directory_security = make_unique<DirectorySecurity>(g_options.dir_aces);
+        }
+
+        auto scenarios = FindScenarios(pattern);
+        if (scenarios.empty()) {
+            throw ArgException("Unknown test: " + pattern + ".");
+        }
+        CheckParams(scenarios, options);
+
+        unique_ptr<FILE, decltype(&fclose)> heatmap_fp(nullptr, fclose);
+        if (!heatmap_path.empty()) {
+            FILE* fp = nullptr;
+            if (fopen_s(&fp, heatmap_path.c_str(), "w") != 0) {
+                throw ArgException("Can't open heatmap file: " + heatmap_path);
+            }
+            heatmap_fp.reset(fp);
+            options.heatmap_fp = fp;
+            fprintf(fp, "scenario,params,slice_ms,latency_ns,count\n");
+            g_options.heatmap_interval_ms = heatmap_interval_ms;
+        }
+        unique_ptr<FILE, decltype(&fclose)> profile_fp(nullptr, fclose);
+        if (!profile_path.empty()) {
+            FILE* fp = nullptr;
+            if (fopen_s(&fp, profile_path.c_str(), "w") != 0) {
+                throw ArgException("Can't open profile file: " + profile_path);
+            }
+            profile_fp.reset(fp);
+            options.profile_fp = fp;
+            SymSetOptions(SYMOPT_UNDNAME | SYMOPT_DEFERRED_LOADS);
+            SymInitialize(GetCurrentProcess(), nullptr, TRUE);
+            g_options.profile_interval_ms = profile_interval_ms;
+        }
+        for (auto scenario : scenarios) {
+            if (options.search) {
+                SearchScenario(*scenario, options);
+            }
+            else {
+                RunScenario(*scenario, options);
+            }
+        }
     }
     catch (const NtException& ex) {
         printf("Error in program: %08X\n", ex.status());
     }
+    catch (const ArgException& ex) {
+        printf("%s\n", ex.message().c_str());
+        PrintHelp();
+        return 1;
+    }
 
     return 0;
 }